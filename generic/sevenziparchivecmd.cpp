@@ -1,5 +1,7 @@
 #include "sevenziparchivecmd.hpp"
+#include "sevenzipchannel.hpp"
 
+#include <stdlib.h>
 #include <string.h>
 #include <wchar.h>
 
@@ -13,8 +15,15 @@
 #define LIST_MATCH_NOCASE TCL_MATCH_NOCASE
 #define LIST_MATCH_EXACT (1 << 16)
 
+// NOTE: the item size comes from the archive and is not trusted, the
+// NOTE: preallocation is limited by this and by a ratio of the packed size,
+// NOTE: larger data grows the byte array as it is decoded
+#define EXTRACT_PRESIZE_MAX (4 * 1024 * 1024)
+#define EXTRACT_PRESIZE_RATIO 32
+
 // from CPP/Common/MyWindows.h - only the needed values
 enum {
+    VT_EMPTY = 0,
     VT_I2 = 2,
     VT_I4 = 3,
     VT_BSTR = 8,
@@ -32,6 +41,11 @@ enum {
 enum {
     kpidPath = 3,
     kpidIsDir = 6,
+    kpidSize = 7,
+    kpidPackSize = 8,
+    kpidSolid = 13,
+    kpidEncrypted = 15,
+    kpidOffset = 36,
     kpidPhySize = 44
 };
 
@@ -144,7 +158,12 @@ static const char *const SevenzipProperties[] = {
     "devminor"
 };
 
+#define PROPERTY_COUNT (sizeof(SevenzipProperties)/sizeof(SevenzipProperties[0]))
+#define PROPERTY_KEYS_ASSOC "sevenzip::propertyKeys"
+
 static int Tcl_StringCaseEqual(const char *str1, const char *str2, int nocase);
+static int Path_Match(const char *path, const char *pattern, int flags);
+static int Path_IsSafe(const char *path);
 #ifdef _WIN32
 static char *Path_WindowsPathToUnixPath(char *path);
 #endif
@@ -156,9 +175,29 @@ SevenzipArchiveCmd::SevenzipArchiveCmd (Tcl_Interp *interp, const char *name, Tc
 
 SevenzipArchiveCmd::~SevenzipArchiveCmd() {
     DEBUGLOG(this << " ~SevenzipArchiveCmd");
+    if (deletedFlag)
+        *deletedFlag = true;
     Close();
 }
 
+// NOTE: the extraction job run by the bridge worker thread
+struct SevenzipExtractJob {
+    sevenzip::Iarchive *archive;
+    sevenzip::Ostream *stream;
+    const wchar_t *password;
+    int index;
+    bool multithread;
+};
+
+static HRESULT SevenzipExtractProc(void *clientData) {
+    SevenzipExtractJob *job = (SevenzipExtractJob *)clientData;
+    job->archive->addBoolOption(L"mt", job->multithread);
+    HRESULT hr = job->archive->extract(*job->stream, job->password, job->index);
+    if (hr == E_NOINTERFACE) // looks like options are not supported, skip error
+        hr = job->archive->extract(*job->stream, job->password, job->index);
+    return hr;
+}
+
 HRESULT SevenzipArchiveCmd::Open(sevenzip::Lib& lib, SevenzipInStream* stream,
         Tcl_Obj* filename, Tcl_Obj* password, int formatIndex) {
     DEBUGLOG(this << " SevenzipArchiveCmd::Open"
@@ -169,9 +208,23 @@ HRESULT SevenzipArchiveCmd::Open(sevenzip::Lib& lib, SevenzipInStream* stream,
     if (this->stream)
         return E_FAIL;
     this->stream = stream;
+    // NOTE: the archive reads through the bridge, so codec threads never touch Tcl
+    bridgeStream = new SevenzipBridgeInStream(&bridge, stream, false);
+
+    this->lib = &lib;
+    this->formatIndex = formatIndex;
+    if (filename) {
+        Tcl_Obj *normalized = Tcl_FSGetNormalizedPath(NULL, filename);
+        this->filename = normalized ? normalized : filename;
+        Tcl_IncrRefCount(this->filename);
+    }
+    if (password) {
+        this->password = password;
+        Tcl_IncrRefCount(this->password);
+    }
 
     wchar_t buffer[1024];
-    return archive.open(lib, *stream,
+    return archive.open(lib, *bridgeStream,
             filename ? sevenzip::fromBytes(Tcl_GetString(filename)) : NULL,
             password ? sevenzip::fromBytes(buffer, sizeof(buffer)/sizeof(buffer[0]), Tcl_GetString(password)) : NULL,
             formatIndex);
@@ -179,11 +232,29 @@ HRESULT SevenzipArchiveCmd::Open(sevenzip::Lib& lib, SevenzipInStream* stream,
 
 void SevenzipArchiveCmd::Close() {
     DEBUGLOG(this << " SevenzipArchiveCmd::Close");
+    if (mount) {
+        delete mount;
+        mount = NULL;
+    }
+    ClearItemIndex();
     archive.close();
+    if (bridgeStream) {
+        delete bridgeStream;
+        bridgeStream = NULL;
+    }
     if (stream) {
         delete stream;
         stream = NULL;
     }
+    if (filename) {
+        Tcl_DecrRefCount(filename);
+        filename = NULL;
+    }
+    if (password) {
+        Tcl_DecrRefCount(password);
+        password = NULL;
+    }
+    lib = NULL;
 }
 
 void SevenzipArchiveCmd::Cleanup() {
@@ -192,10 +263,10 @@ void SevenzipArchiveCmd::Cleanup() {
 
 int SevenzipArchiveCmd::Command (int objc, Tcl_Obj *const objv[]) {
     static const char *const commands[] = {
-        "info", "count", "list", "extract", "close", 0L
+        "info", "count", "list", "foreach", "extract", "read", "open", "close", 0L
     };
     enum commands {
-        cmInfo, cmCount, cmList, cmExtract, cmClose
+        cmInfo, cmCount, cmList, cmForeach, cmExtract, cmRead, cmOpen, cmClose
     };
     int index;
 
@@ -237,15 +308,17 @@ int SevenzipArchiveCmd::Command (int objc, Tcl_Obj *const objv[]) {
 
         if (objc >= 2) {
             static const char * const options[] = {
-                "-info", "-nocase", "-exact", "-type", "--", 0L
+                "-info", "-fields", "-path", "-nocase", "-exact", "-type", "--", 0L
             };
             enum options {
-                opInfo, opNocase, opExact, opType, opEnd
+                opInfo, opFields, opPath, opNocase, opExact, opType, opEnd
             };
             int index;
             int flags = 0;
             char type = 'a';
             bool info = false;
+            Tcl_Obj *fields = NULL;
+            Tcl_Obj *dir = NULL;
             Tcl_Obj *patternObj = NULL;
             for (int i = 2; i < objc; i++) {
                 if (Tcl_GetIndexFromObj(tclInterp, objv[i], options, "option", 0, &index) != TCL_OK) {
@@ -259,6 +332,24 @@ int SevenzipArchiveCmd::Command (int objc, Tcl_Obj *const objv[]) {
                 case opInfo:
                     info = true;
                     continue;
+                case opFields:
+                    i++;
+                    if (i < objc) {
+                        fields = objv[i];
+                        continue;
+                    }
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-fields\" option must be followed by list of fields", -1));
+                    return TCL_ERROR;
+                case opPath:
+                    i++;
+                    if (i < objc) {
+                        dir = objv[i];
+                        continue;
+                    }
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-path\" option must be followed by item path", -1));
+                    return TCL_ERROR;
                 case opNocase:
                     flags |= LIST_MATCH_NOCASE;
                     continue;
@@ -286,7 +377,7 @@ int SevenzipArchiveCmd::Command (int objc, Tcl_Obj *const objv[]) {
                 };
                 break;
             };
-            if (List(Tcl_GetObjResult(tclInterp), patternObj, type, flags, info) != TCL_OK)
+            if (List(Tcl_GetObjResult(tclInterp), patternObj, type, flags, info, fields, dir) != TCL_OK)
                 return TCL_ERROR;
         } else {
             Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? ?pattern?");
@@ -294,44 +385,272 @@ int SevenzipArchiveCmd::Command (int objc, Tcl_Obj *const objv[]) {
         }
         break;
 
+    case cmForeach:
+
+        // foreach ?-info? ?-fields list? ?-path dir? ?-nocase? ?-exact? ?-type d|f? ?--? varName ?pattern? body
+        if (objc >= 4) {
+            static const char * const options[] = {
+                "-info", "-fields", "-path", "-nocase", "-exact", "-type", "--", 0L
+            };
+            enum options {
+                opInfo, opFields, opPath, opNocase, opExact, opType, opEnd
+            };
+            int index;
+            int flags = 0;
+            char type = 'a';
+            bool info = false;
+            Tcl_Obj *fields = NULL;
+            Tcl_Obj *dir = NULL;
+            int i;
+            for (i = 2; i < objc - 2; i++) {
+                if (Tcl_GetString(objv[i])[0] != '-')
+                    break;
+                if (Tcl_GetIndexFromObj(tclInterp, objv[i], options, "option", 0, &index) != TCL_OK)
+                    return TCL_ERROR;
+                if ((enum options)(index) == opEnd) {
+                    i++;
+                    break;
+                }
+                switch ((enum options)(index)) {
+                case opInfo:
+                    info = true;
+                    break;
+                case opFields:
+                    i++;
+                    if (i < objc - 2) {
+                        fields = objv[i];
+                        break;
+                    }
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-fields\" option must be followed by list of fields", -1));
+                    return TCL_ERROR;
+                case opPath:
+                    i++;
+                    if (i < objc - 2) {
+                        dir = objv[i];
+                        break;
+                    }
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-path\" option must be followed by item path", -1));
+                    return TCL_ERROR;
+                case opNocase:
+                    flags |= LIST_MATCH_NOCASE;
+                    break;
+                case opExact:
+                    flags |= LIST_MATCH_EXACT;
+                    break;
+                case opType:
+                    i++;
+                    if (i < objc - 2 && Tcl_GetCharLength(objv[i]) == 1) {
+                        type = Tcl_GetString(objv[i])[0];
+                        if (type == 'd' || type == 'f')
+                            break;
+                    }
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-type\" option must be followed by \"d\" or \"f\"", -1));
+                    return TCL_ERROR;
+                default:
+                    break;
+                }
+            }
+            if (objc - i != 2 && objc - i != 3) {
+                Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? varName ?pattern? body");
+                return TCL_ERROR;
+            }
+            return Foreach(objv[i], objc - i == 3 ? objv[i+1] : NULL, type, flags, info, fields, dir,
+                    objv[objc-1]);
+        } else {
+            Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? varName ?pattern? body");
+            return TCL_ERROR;
+        }
+        break;
+
     case cmExtract:
         if (objc >= 4) {
             static const char *const options[] = {
-                "-password", "-channel", 0L
+                "-password", "-channel", "-multithread", "-buffersize", "-readahead",
+                "-directory", "-nocase", "-exact", "-type", "--", 0L
             };
             enum options {
-                opPassword, opChannel
+                opPassword, opChannel, opMultithread, opBuffersize, opReadahead,
+                opDirectory, opNocase, opExact, opType, opEnd
             };
             int index;
+            int flags = 0;
+            char type = 'a';
             bool usechannel = false;
+            bool multithread = false;
+            bool readahead = false;
+            Tcl_WideInt buffersize = 0;
             Tcl_Obj *password = NULL;
-            for (int i = 2; i < objc - 2; i++) {
+            Tcl_Obj *directory = NULL;
+            const char *selectOption = NULL;
+            int i;
+            for (i = 2; i < objc; i++) {
+                // NOTE: without -directory the last two arguments are path and item
+                int last = directory ? objc : objc - 2;
+                if (i >= last && strcmp(Tcl_GetString(objv[i]), "-directory") != 0)
+                    break;
                 if (Tcl_GetIndexFromObj(tclInterp, objv[i], options, "option", 0, &index) != TCL_OK) {
-                    return TCL_ERROR;
+                    if (!directory)
+                        return TCL_ERROR;
+                    Tcl_ResetResult(tclInterp);
+                    break;
                 }
                 switch ((enum options)(index)) {
                 case opPassword:
-                    if (i < objc - 3) {
+                    if (i < last - 1) {
                         password = objv[++i];
                     } else {
                         Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
                             "\"-password\" option must be followed by password", -1));
                         return TCL_ERROR;
                     }
-                    break;                
+                    continue;
                 case opChannel:
                     usechannel = true;
+                    continue;
+                case opMultithread:
+                    multithread = true;
+                    continue;
+                case opBuffersize:
+                    if (i < last - 1 && Tcl_GetWideIntFromObj(NULL, objv[i+1], &buffersize) == TCL_OK && buffersize > 0) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-buffersize\" option must be followed by buffer size", -1));
+                        return TCL_ERROR;
+                    }
+                    continue;
+                case opReadahead:
+                    readahead = true;
+                    continue;
+                case opDirectory:
+                    if (i < objc - 1) {
+                        directory = objv[++i];
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-directory\" option must be followed by directory", -1));
+                        return TCL_ERROR;
+                    }
+                    continue;
+                case opNocase:
+                    flags |= LIST_MATCH_NOCASE;
+                    selectOption = "-nocase";
+                    continue;
+                case opExact:
+                    flags |= LIST_MATCH_EXACT;
+                    selectOption = "-exact";
+                    continue;
+                case opType:
+                    selectOption = "-type";
+                    i++;
+                    if (i < objc && Tcl_GetCharLength(objv[i]) == 1) {
+                        type = Tcl_GetString(objv[i])[0];
+                        if (type == 'd' || type == 'f')
+                            continue;
+                    }
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-type\" option must be followed by \"d\" or \"f\"", -1));
+                    return TCL_ERROR;
+                case opEnd:
+                    selectOption = "--";
+                    i++;
                     break;
                 }
+                break;
+            }
+            if (directory) {
+                if (usechannel) {
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                        "\"-channel\" option can not be used with \"-directory\" option", -1));
+                    return TCL_ERROR;
+                }
+                if (ExtractAll(directory, objc - i, objv + i, type, flags, password, multithread,
+                        (size_t)buffersize, readahead) != TCL_OK)
+                    return TCL_ERROR;
+            } else {
+                if (selectOption) {
+                    Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                        "\"%s\" option requires \"-directory\" option", selectOption));
+                    return TCL_ERROR;
+                }
+                if (Extract(objv[objc-1], objv[objc-2], password, usechannel, multithread,
+                        (size_t)buffersize, readahead) != TCL_OK)
+                    return TCL_ERROR;
             }
-            if (Extract(objv[objc-1], objv[objc-2], password, usechannel) != TCL_OK)
-                return TCL_ERROR;
         } else {
             Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? path item");
             return TCL_ERROR;
         }
         break;
 
+    case cmRead:
+        if (objc >= 3 && objc % 2 == 1) {
+            static const char *const options[] = {
+                "-password", "-offset", "-length", 0L
+            };
+            enum options {
+                opPassword, opOffset, opLength
+            };
+            int index;
+            Tcl_Obj *password = NULL;
+            Tcl_WideInt offset = 0;
+            Tcl_WideInt length = -1;
+            for (int i = 2; i < objc - 1; i += 2) {
+                if (Tcl_GetIndexFromObj(tclInterp, objv[i], options, "option", 0, &index) != TCL_OK)
+                    return TCL_ERROR;
+                switch ((enum options)(index)) {
+                case opPassword:
+                    password = objv[i+1];
+                    break;
+                case opOffset:
+                    if (Tcl_GetWideIntFromObj(NULL, objv[i+1], &offset) != TCL_OK || offset < 0) {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-offset\" option must be followed by non-negative offset", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opLength:
+                    if (Tcl_GetWideIntFromObj(NULL, objv[i+1], &length) != TCL_OK || length < 0) {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-length\" option must be followed by non-negative length", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                }
+            }
+            if (Read(objv[objc-1], password, offset, length) != TCL_OK)
+                return TCL_ERROR;
+        } else {
+            Tcl_WrongNumArgs(tclInterp, 2, objv, "?-password password? ?-offset offset? ?-length length? item");
+            return TCL_ERROR;
+        }
+        break;
+
+    case cmOpen:
+        if (objc == 3 || (objc == 5 && strcmp(Tcl_GetString(objv[2]), "-password") == 0)) {
+            Tcl_Obj *password = objc == 5 ? objv[3] : NULL;
+            int i = FindItem(Tcl_GetString(objv[objc-1]));
+            while (i >= 0 && ItemIsDir(i))
+                i = FindNextItem(i);
+            if (i < 0) {
+                Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("no such item \"%s\" in the archive",
+                        Tcl_GetString(objv[objc-1])));
+                return TCL_ERROR;
+            }
+            Tcl_Channel channel;
+            HRESULT hr = OpenChannel(i, password, channel);
+            if (hr != S_OK)
+                return lastError(tclInterp, hr);
+            Tcl_RegisterChannel(tclInterp, channel);
+            Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(Tcl_GetChannelName(channel), -1));
+        } else {
+            Tcl_WrongNumArgs(tclInterp, 2, objv, "?-password password? item");
+            return TCL_ERROR;
+        }
+        break;
+
     case cmClose:
         if (objc > 2) {
             Tcl_WrongNumArgs(tclInterp, 2, objv, NULL);
@@ -345,6 +664,36 @@ int SevenzipArchiveCmd::Command (int objc, Tcl_Obj *const objv[]) {
     return TCL_OK;
 };
 
+static void PropertyKeys_Delete(ClientData clientData, Tcl_Interp *interp) {
+    (void)interp;
+    Tcl_Obj **keys = (Tcl_Obj **)clientData;
+    for (size_t i = 0; i < PROPERTY_COUNT; i++) {
+        if (keys[i])
+            Tcl_DecrRefCount(keys[i]);
+    }
+    ckfree(keys);
+}
+
+Tcl_Obj *SevenzipArchiveCmd::PropertyKey(PROPID propId) {
+    if (propId >= PROPERTY_COUNT)
+        return Tcl_ObjPrintf("prop%d", propId);
+    // NOTE: the keys are shared by all archives of the interpreter and live
+    // NOTE: as long as it does, one object per property name
+    if (propertyKeys == NULL) {
+        propertyKeys = (Tcl_Obj **)Tcl_GetAssocData(tclInterp, PROPERTY_KEYS_ASSOC, NULL);
+        if (propertyKeys == NULL) {
+            propertyKeys = (Tcl_Obj **)ckalloc(sizeof(Tcl_Obj *) * PROPERTY_COUNT);
+            memset(propertyKeys, 0, sizeof(Tcl_Obj *) * PROPERTY_COUNT);
+            Tcl_SetAssocData(tclInterp, PROPERTY_KEYS_ASSOC, PropertyKeys_Delete, propertyKeys);
+        }
+    }
+    if (propertyKeys[propId] == NULL) {
+        propertyKeys[propId] = Tcl_NewStringObj(SevenzipProperties[propId], -1);
+        Tcl_IncrRefCount(propertyKeys[propId]);
+    }
+    return propertyKeys[propId];
+}
+
 int SevenzipArchiveCmd::Info(Tcl_Obj *info) {
     int n = archive.getNumberOfProperties();
     for (int i = 0; i < n; i++) {
@@ -388,11 +737,7 @@ int SevenzipArchiveCmd::Info(Tcl_Obj *info) {
                 break;
             }
             if (value) {
-                Tcl_ListObjAppendElement(NULL, info, 
-                    propId < sizeof(SevenzipProperties)/sizeof(SevenzipProperties[0]) 
-                        ? Tcl_NewStringObj(SevenzipProperties[propId], -1)
-                        : Tcl_ObjPrintf("prop%d", propId));
-                Tcl_ListObjAppendElement(NULL, info, value);
+                Tcl_DictObjPut(NULL, info, PropertyKey(propId), value);
             } else {
                 // DEBUGLOG(this << " SevenzipArchiveCmd unhandled prop id " << propId << " type " << propType);
             }
@@ -401,207 +746,897 @@ int SevenzipArchiveCmd::Info(Tcl_Obj *info) {
     return TCL_OK;
 }
 
-int SevenzipArchiveCmd::List(Tcl_Obj *list, Tcl_Obj *pattern, char type, int flags, bool info) {
-    DEBUGLOG(this << " SevenzipArchiveCmd::List " << (pattern ? Tcl_GetString(pattern) : "NULL")
-            << " " << type << " " << flags << " " << info);
-    unsigned int count = archive.getNumberOfItems();
-    for (unsigned int i = 0; i < count; ++i) {
-        if (type == 'd' && !archive.getItemIsDir(i))
+template <typename F>
+int SevenzipArchiveCmd::EachItem(Tcl_Obj *pattern, Tcl_Obj *dir, char type, int flags, const F &func) {
+    if (dir) {
+        // NOTE: the items below dir are adjacent in the sorted index, the
+        // NOTE: subtree of each subdirectory is skipped by another lookup
+        Tcl_DString prefix;
+        Tcl_DStringInit(&prefix);
+        Tcl_DStringAppend(&prefix, Tcl_GetString(dir), -1);
+        while (Tcl_DStringLength(&prefix) > 0
+                && Tcl_DStringValue(&prefix)[Tcl_DStringLength(&prefix) - 1] == '/')
+            Tcl_DStringSetLength(&prefix, Tcl_DStringLength(&prefix) - 1);
+        if (Tcl_DStringLength(&prefix) > 0)
+            Tcl_DStringAppend(&prefix, "/", 1);
+        Tcl_Size length = Tcl_DStringLength(&prefix);
+        int count = ItemCount();
+        int result = TCL_OK;
+        if (flags & TCL_MATCH_NOCASE) {
+            // NOTE: the sorted index is case sensitive, a case insensitive
+            // NOTE: directory is looked up by a scan of all items
+            Tcl_Size chars = Tcl_NumUtfChars(Tcl_DStringValue(&prefix), length);
+            for (int i = 0; i < count; i++) {
+                const char *path = ItemPath(i);
+                if (Tcl_UtfNcasecmp(path, Tcl_DStringValue(&prefix), chars) != 0)
+                    continue;
+                const char *tail = Tcl_UtfAtIndex(path, chars);
+                if (!*tail || strchr(tail, '/'))
+                    continue;
+                if (type == 'd' && !ItemIsDir(i))
+                    continue;
+                if (type == 'f' && ItemIsDir(i))
+                    continue;
+                if (pattern && !Path_Match(tail, Tcl_GetString(pattern), flags))
+                    continue;
+                result = func(i, path);
+                if (result != TCL_OK)
+                    break;
+            }
+            Tcl_DStringFree(&prefix);
+            return result;
+        }
+        for (int k = FindSortedItem(Tcl_DStringValue(&prefix)); k < count; k++) {
+            const char *path = itemSorted[k].path;
+            if (strncmp(path, Tcl_DStringValue(&prefix), length) != 0)
+                break;
+            const char *tail = path + length;
+            const char *slash = strchr(tail, '/');
+            if (slash) {
+                // NOTE: '0' is the character after '/', the first path past the subtree
+                Tcl_DStringAppend(&prefix, tail, (Tcl_Size)(slash - tail));
+                Tcl_DStringAppend(&prefix, "0", 1);
+                k = FindSortedItem(Tcl_DStringValue(&prefix)) - 1;
+                Tcl_DStringSetLength(&prefix, length);
+                continue;
+            }
+            int i = itemSorted[k].index;
+            if (!*tail)
+                continue;
+            if (type == 'd' && !ItemIsDir(i))
+                continue;
+            if (type == 'f' && ItemIsDir(i))
+                continue;
+            if (pattern && !Path_Match(tail, Tcl_GetString(pattern), flags))
+                continue;
+            result = func(i, path);
+            if (result != TCL_OK)
+                break;
+        }
+        Tcl_DStringFree(&prefix);
+        return result;
+    }
+    if (pattern && (flags & LIST_MATCH_EXACT) && !(flags & TCL_MATCH_NOCASE)) {
+        // NOTE: exact case sensitive match, use the item index instead of scanning
+        for (int i = FindItem(Tcl_GetString(pattern)); i >= 0; i = FindNextItem(i)) {
+            if (type == 'd' && !ItemIsDir(i))
+                continue;
+            if (type == 'f' && ItemIsDir(i))
+                continue;
+            int result = func(i, ItemPath(i));
+            if (result != TCL_OK)
+                return result;
+        }
+        return TCL_OK;
+    }
+    int count = ItemCount();
+    for (int i = 0; i < count; ++i) {
+        if (type == 'd' && !ItemIsDir(i))
+            continue;
+        if (type == 'f' && ItemIsDir(i))
             continue;
-        if (type == 'f' && archive.getItemIsDir(i))
+        const char *path = ItemPath(i);
+        if (pattern && !Path_Match(path, Tcl_GetString(pattern), flags))
+            continue;
+        int result = func(i, path);
+        if (result != TCL_OK)
+            return result;
+    }
+    return TCL_OK;
+}
+
+int SevenzipArchiveCmd::ResolveFields(Tcl_Obj *fields, int &fieldc, ItemField *&fieldv) {
+    Tcl_Size objc;
+    Tcl_Obj **objv;
+    if (Tcl_ListObjGetElements(tclInterp, fields, &objc, &objv) != TCL_OK)
+        return TCL_ERROR;
+    fieldv = (ItemField *)ckalloc(sizeof(ItemField) * (objc ? objc : 1));
+    fieldc = (int)objc;
+    for (int j = 0; j < fieldc; j++) {
+        const char *name = Tcl_GetString(objv[j]);
+        PROPID propId;
+        for (propId = 0; propId < PROPERTY_COUNT; propId++) {
+            if (strcmp(name, SevenzipProperties[propId]) == 0)
+                break;
+        }
+        if (propId == PROPERTY_COUNT) {
+            ckfree(fieldv);
+            fieldv = NULL;
+            Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("unknown field \"%s\"", name));
+            return TCL_ERROR;
+        }
+        fieldv[j].id = propId;
+        fieldv[j].type = VT_EMPTY;
+    }
+    // NOTE: the types come from the archive format, not from the items,
+    // NOTE: fields the format does not have stay VT_EMPTY and are left out
+    int n = archive.getNumberOfItemProperties();
+    for (int k = 0; k < n; k++) {
+        PROPID propId;
+        VARTYPE propType;
+        if (archive.getItemPropertyInfo(k, propId, propType) != S_OK)
             continue;
+        for (int j = 0; j < fieldc; j++) {
+            if (fieldv[j].id == propId)
+                fieldv[j].type = propType;
+        }
+    }
+    return TCL_OK;
+}
+
+int SevenzipArchiveCmd::List(Tcl_Obj *list, Tcl_Obj *pattern, char type, int flags, bool info,
+        Tcl_Obj *fields, Tcl_Obj *dir) {
+    DEBUGLOG(this << " SevenzipArchiveCmd::List " << (pattern ? Tcl_GetString(pattern) : "NULL")
+            << " " << type << " " << flags << " " << info);
+    int fieldc = 0;
+    ItemField *fieldv = NULL;
+    if (fields && ResolveFields(fields, fieldc, fieldv) != TCL_OK)
+        return TCL_ERROR;
+    int result = EachItem(pattern, dir, type, flags, [&](int i, const char *path) {
+        Tcl_ListObjAppendElement(NULL, list, ItemObj(i, path, info, fieldc, fieldv));
+        return TCL_OK;
+    });
+    if (fieldv)
+        ckfree(fieldv);
+    return result;
+}
+
+int SevenzipArchiveCmd::Foreach(Tcl_Obj *varName, Tcl_Obj *pattern, char type, int flags, bool info,
+        Tcl_Obj *fields, Tcl_Obj *dir, Tcl_Obj *body) {
+    DEBUGLOG(this << " SevenzipArchiveCmd::Foreach " << (pattern ? Tcl_GetString(pattern) : "NULL")
+            << " " << type << " " << flags << " " << info);
+    // NOTE: the body may close the archive, then the loop ends without
+    // NOTE: touching this object again; the flags of nested loops are chained
+    Tcl_Interp *interp = tclInterp;
+    int fieldc = 0;
+    ItemField *fieldv = NULL;
+    if (fields && ResolveFields(fields, fieldc, fieldv) != TCL_OK)
+        return TCL_ERROR;
+    bool deleted = false;
+    bool *outerDeleted = deletedFlag;
+    deletedFlag = &deleted;
+    int result = EachItem(pattern, dir, type, flags, [&](int i, const char *path) {
+        // NOTE: only the current item is held, memory does not grow with the archive
+        if (Tcl_ObjSetVar2(interp, varName, NULL, ItemObj(i, path, info, fieldc, fieldv), TCL_LEAVE_ERR_MSG) == NULL)
+            return TCL_ERROR;
+        int code = Tcl_EvalObjEx(interp, body, 0);
+        if (deleted)
+            return code == TCL_OK || code == TCL_CONTINUE ? TCL_BREAK : code;
+        return code == TCL_CONTINUE ? TCL_OK : code;
+    });
+    if (deleted) {
+        if (outerDeleted)
+            *outerDeleted = true;
+    } else {
+        deletedFlag = outerDeleted;
+    }
+    if (fieldv)
+        ckfree(fieldv);
+    switch (result) {
+    case TCL_OK:
+    case TCL_BREAK:
+        Tcl_ResetResult(interp);
+        return TCL_OK;
+    case TCL_ERROR:
+        Tcl_AppendObjToErrorInfo(interp, Tcl_ObjPrintf(
+                "\n    (\"foreach\" body line %d)", Tcl_GetErrorLine(interp)));
+        return TCL_ERROR;
+    default:
+        return result;
+    }
+}
 
+Tcl_Obj *SevenzipArchiveCmd::PropertyObj(int i, PROPID propId, VARTYPE propType) {
+    const wchar_t* stringValue = NULL;
+    bool boolValue = false;
+    UInt32 uint32Value = 0;
+    UInt64 uint64Value = 0;
+    Tcl_Obj *value = NULL;
+    switch (propType) {
+    case VT_BSTR:
 #ifdef _WIN32
-        char *path = Path_WindowsPathToUnixPath(sevenzip::toBytes(archive.getItemPath(i)));
-#else
-        char *path = sevenzip::toBytes(archive.getItemPath(i));
+        if (propId == kpidPath) {
+            if (archive.getStringItemProperty(i, propId, stringValue) == S_OK)
+                value = Tcl_NewStringObj(Path_WindowsPathToUnixPath(sevenzip::toBytes(stringValue)), -1);
+            break;
+        }
 #endif
-        if (pattern) {
-            if (flags & LIST_MATCH_EXACT) {
-                if (!Tcl_StringCaseEqual(path, Tcl_GetString(pattern), flags & TCL_MATCH_NOCASE))
-                    continue;
-            } else { 
-                if (!Tcl_StringCaseMatch(path, Tcl_GetString(pattern), flags & TCL_MATCH_NOCASE))
-                    continue;
+        if (archive.getStringItemProperty(i, propId, stringValue) == S_OK)
+            value = Tcl_NewStringObj(sevenzip::toBytes(stringValue), -1);
+        break;
+    case VT_BOOL:
+        if (archive.getBoolItemProperty(i, propId, boolValue) == S_OK)
+            value = Tcl_NewBooleanObj(boolValue);
+        break;
+    case VT_I1:
+    case VT_I2:
+    case VT_I4:
+    case VT_UI1:
+    case VT_UI2:
+    case VT_UI4:
+        if (archive.getIntItemProperty(i, propId, uint32Value) == S_OK)
+            value = Tcl_NewWideIntObj(uint32Value);
+        // NOTE: see note below about some 64bit values
+        else if (archive.getWideItemProperty(i, propId, uint64Value) == S_OK)
+            value = Tcl_NewWideIntObj(uint64Value);
+        break;
+    case VT_I8:
+    case VT_UI8:
+        if (archive.getWideItemProperty(i, propId, uint64Value) == S_OK)
+            value = Tcl_NewWideIntObj(uint64Value);
+        // NOTE: some 64bit values (like arj size) are returned as VT_UI4
+        else if (archive.getIntItemProperty(i, propId, uint32Value) == S_OK)
+            value = Tcl_NewWideIntObj(uint32Value);
+        break;
+    case VT_FILETIME:
+        if (archive.getTimeItemProperty(i, propId, uint32Value) == S_OK)
+            value = Tcl_NewWideIntObj(uint32Value);
+        break;
+    default:
+        // DEBUGLOG(this << " SevenzipArchiveCmd::List info unknown item " << i << " prop id " << propId << " type " << propType);
+        break;
+    }
+    return value;
+}
+
+Tcl_Obj *SevenzipArchiveCmd::ItemObj(int i, const char *path, bool info, int fieldc, const ItemField *fieldv) {
+    if (fieldv) {
+        Tcl_Obj *prop = Tcl_NewDictObj();
+        for (int j = 0; j < fieldc; j++) {
+            Tcl_Obj *value = NULL;
+            // NOTE: the path is already known from the item scan, isdir is always available
+            if (fieldv[j].id == kpidPath)
+                value = Tcl_NewStringObj(path, -1);
+            else if (fieldv[j].id == kpidIsDir && fieldv[j].type == VT_EMPTY)
+                value = Tcl_NewBooleanObj(ItemIsDir(i));
+            else if (fieldv[j].type != VT_EMPTY)
+                value = PropertyObj(i, fieldv[j].id, fieldv[j].type);
+            if (value) {
+                Tcl_DictObjPut(NULL, prop, PropertyKey(fieldv[j].id), value);
             }
         }
-        if (info) {
-            Tcl_Obj *prop = Tcl_NewObj();
-            bool haveIsDirProperty = false;
-            int n = archive.getNumberOfItemProperties();
-            for (int j = 0; j < n; j++) {
-                PROPID propId;
-                VARTYPE propType;
-                if (archive.getItemPropertyInfo(j, propId, propType) == S_OK) {
-                    const wchar_t* stringValue = NULL;
-                    bool boolValue = false;
-                    UInt32 uint32Value = 0;
-                    UInt64 uint64Value = 0;
-                    Tcl_Obj *value = NULL;
-                    switch (propType) {
-                    case VT_BSTR:
-#ifdef _WIN32
-                        if (propId == kpidPath) {
-                            if (archive.getStringItemProperty(i, propId, stringValue) == S_OK)
-                                value = Tcl_NewStringObj(Path_WindowsPathToUnixPath(sevenzip::toBytes(stringValue)), -1);
-                            break;
-                        }
-#endif
-                        if (archive.getStringItemProperty(i, propId, stringValue) == S_OK)
-                            value = Tcl_NewStringObj(sevenzip::toBytes(stringValue), -1);
-                        break;
-                    case VT_BOOL:
-                        if (archive.getBoolItemProperty(i, propId, boolValue) == S_OK)
-                            value = Tcl_NewBooleanObj(boolValue);
-                        break;
-                    case VT_I1:
-                    case VT_I2:
-                    case VT_I4:
-                    case VT_UI1:
-                    case VT_UI2:
-                    case VT_UI4:
-                        if (archive.getIntItemProperty(i, propId, uint32Value) == S_OK)
-                            value = Tcl_NewWideIntObj(uint32Value);
-                        // NOTE: see note below about some 64bit values
-                        else if (archive.getWideItemProperty(i, propId, uint64Value) == S_OK)
-                            value = Tcl_NewWideIntObj(uint64Value);
-                        break;
-                    case VT_I8:
-                    case VT_UI8:
-                        if (archive.getWideItemProperty(i, propId, uint64Value) == S_OK)
-                            value = Tcl_NewWideIntObj(uint64Value);
-                        // NOTE: some 64bit values (like arj size) are returned as VT_UI4
-                        else if (archive.getIntItemProperty(i, propId, uint32Value) == S_OK)
-                            value = Tcl_NewWideIntObj(uint32Value);
-                        break;
-                    case VT_FILETIME:
-                        if (archive.getTimeItemProperty(i, propId, uint32Value) == S_OK)
-                            value = Tcl_NewWideIntObj(uint32Value);
-                        break;
-                    default:
-                        // DEBUGLOG(this << " SevenzipArchiveCmd::List info unknown item " << i << " prop id " << propId << " type " << propType);
-                        break;
-                    }
-                    if (value) {
-                        Tcl_ListObjAppendElement(NULL, prop, 
-                                propId < sizeof(SevenzipProperties)/sizeof(SevenzipProperties[0]) 
-                                    ? Tcl_NewStringObj(SevenzipProperties[propId], -1)
-                                    : Tcl_ObjPrintf("prop%d", propId));
-                        Tcl_ListObjAppendElement(NULL, prop, value);
-                    } else {
-                        // DEBUGLOG(this << " SevenzipArchiveCmd::List info unhandled item " << i << " prop id " << propId << " type " << propType);
-                    }
-                    if (propId == kpidIsDir)
-                        haveIsDirProperty = true;
+        return prop;
+    }
+    if (info) {
+        Tcl_Obj *prop = Tcl_NewDictObj();
+        bool haveIsDirProperty = false;
+        int n = archive.getNumberOfItemProperties();
+        for (int j = 0; j < n; j++) {
+            PROPID propId;
+            VARTYPE propType;
+            if (archive.getItemPropertyInfo(j, propId, propType) == S_OK) {
+                Tcl_Obj *value = PropertyObj(i, propId, propType);
+                if (value) {
+                    Tcl_DictObjPut(NULL, prop, PropertyKey(propId), value);
+                } else {
+                    // DEBUGLOG(this << " SevenzipArchiveCmd::List info unhandled item " << i << " prop id " << propId << " type " << propType);
                 }
+                if (propId == kpidIsDir)
+                    haveIsDirProperty = true;
             }
-            if (!haveIsDirProperty) {
-                // append missing but useful isdir property
-                Tcl_ListObjAppendElement(NULL, prop, Tcl_NewStringObj("isdir", -1));
-                Tcl_ListObjAppendElement(NULL, prop, Tcl_NewBooleanObj(archive.getItemIsDir(i)));
-            }
+        }
+        if (!haveIsDirProperty) {
+            // append missing but useful isdir property
+            Tcl_DictObjPut(NULL, prop, PropertyKey(kpidIsDir), Tcl_NewBooleanObj(ItemIsDir(i)));
+        }
 
-            // NOTE: above code may not list all properties (isdir,isanti,...?)
-            // NOTE: There is an alternative way to get all properties
-            
-            // for (PROPID propId = 0; propId < sizeof(SevenzipProperties)/sizeof(SevenzipProperties[0]); propId++) {
-            //     const wchar_t* stringValue;
-            //     bool boolValue;
-            //     UInt32 uint32Value;
-            //     UInt64 uint64Value;
-            //     if (archive.getStringItemProperty(i, propId, stringValue) == S_OK) {
-            //         Tcl_ListObjAppendElement(NULL, prop, Tcl_NewStringObj(SevenzipProperties[propId], -1));
-            //         Tcl_ListObjAppendElement(NULL, prop, Tcl_NewStringObj(sevenzip::toBytes(stringValue), -1));
-            //     } else if (archive.getBoolItemProperty(i, propId, boolValue) == S_OK) {
-            //         Tcl_ListObjAppendElement(NULL, prop, Tcl_NewStringObj(SevenzipProperties[propId], -1));
-            //         Tcl_ListObjAppendElement(NULL, prop, Tcl_NewBooleanObj(boolValue));
-            //     } else if (archive.getIntItemProperty(i, propId, uint32Value) == S_OK) {
-            //         Tcl_ListObjAppendElement(NULL, prop, Tcl_NewStringObj(SevenzipProperties[propId], -1));
-            //         Tcl_ListObjAppendElement(NULL, prop, Tcl_NewIntObj(uint32Value));
-            //     } else if (archive.getWideItemProperty(i, propId, uint64Value) == S_OK) {
-            //         Tcl_ListObjAppendElement(NULL, prop, Tcl_NewStringObj(SevenzipProperties[propId], -1));
-            //         Tcl_ListObjAppendElement(NULL, prop, Tcl_NewWideIntObj(uint64Value));
-            //     } else {
-            //         DEBUGLOG(this << "SevenzipArchiveCmd unhandled item " << i << " prop " << SevenzipProperties[propId]);
-            //     }
-            // }
-            Tcl_ListObjAppendElement(NULL, list, prop);
-        } else {
-            Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj(path, -1));
+        // NOTE: above code may not list all properties (isdir,isanti,...?)
+        // NOTE: There is an alternative way to get all properties
+        
+        // for (PROPID propId = 0; propId < sizeof(SevenzipProperties)/sizeof(SevenzipProperties[0]); propId++) {
+        //     const wchar_t* stringValue;
+        //     bool boolValue;
+        //     UInt32 uint32Value;
+        //     UInt64 uint64Value;
+        //     if (archive.getStringItemProperty(i, propId, stringValue) == S_OK) {
+        //         Tcl_ListObjAppendElement(NULL, prop, Tcl_NewStringObj(SevenzipProperties[propId], -1));
+        //         Tcl_ListObjAppendElement(NULL, prop, Tcl_NewStringObj(sevenzip::toBytes(stringValue), -1));
+        //     } else if (archive.getBoolItemProperty(i, propId, boolValue) == S_OK) {
+        //         Tcl_ListObjAppendElement(NULL, prop, Tcl_NewStringObj(SevenzipProperties[propId], -1));
+        //         Tcl_ListObjAppendElement(NULL, prop, Tcl_NewBooleanObj(boolValue));
+        //     } else if (archive.getIntItemProperty(i, propId, uint32Value) == S_OK) {
+        //         Tcl_ListObjAppendElement(NULL, prop, Tcl_NewStringObj(SevenzipProperties[propId], -1));
+        //         Tcl_ListObjAppendElement(NULL, prop, Tcl_NewIntObj(uint32Value));
+        //     } else if (archive.getWideItemProperty(i, propId, uint64Value) == S_OK) {
+        //         Tcl_ListObjAppendElement(NULL, prop, Tcl_NewStringObj(SevenzipProperties[propId], -1));
+        //         Tcl_ListObjAppendElement(NULL, prop, Tcl_NewWideIntObj(uint64Value));
+        //     } else {
+        //         DEBUGLOG(this << "SevenzipArchiveCmd unhandled item " << i << " prop " << SevenzipProperties[propId]);
+        //     }
+        // }
+        return prop;
+    }
+    return Tcl_NewStringObj(path, -1);
+}
+
+HRESULT SevenzipArchiveCmd::ExtractItems(sevenzip::Ostream &stream, const wchar_t *password,
+        int index, bool multithread, bool readahead) {
+    DEBUGLOG(this << " SevenzipArchiveCmd::ExtractItems " << index << " " << multithread << " " << readahead);
+    if (readahead && this->stream && !this->stream->GetReadahead()) {
+        // NOTE: the archive is read ahead for this extraction only
+        this->stream->SetReadahead(true);
+        HRESULT hr = ExtractItems(stream, password, index, multithread);
+        this->stream->SetReadahead(false);
+        return hr;
+    }
+    SevenzipExtractJob job = {&archive, &stream, password, index, false};
+    if (!multithread)
+        // NOTE: use single thread to avoid Tcl threading issues
+        return SevenzipExtractProc(&job);
+
+    // NOTE: extract in the worker thread, all stream calls of the codec threads
+    // NOTE: are served by this (interpreter) thread in bridge.Join()
+    SevenzipBridgeOutStream bridgeOutStream(&bridge, &stream);
+    job.stream = &bridgeOutStream;
+    job.multithread = true;
+    if (bridge.Start(SevenzipExtractProc, &job))
+        return bridge.Join();
+
+    // NOTE: no threads, fall back to single thread extraction
+    job.stream = &stream;
+    job.multithread = false;
+    return SevenzipExtractProc(&job);
+}
+
+static bool ReadStreamAt(sevenzip::Istream &stream, UInt64 offset, void *data, UInt64 size) {
+    UInt64 position;
+    if (stream.Seek((Int64)offset, SEEK_SET, position) != S_OK || position != offset)
+        return false;
+    while (size > 0) {
+        UInt32 processed = 0;
+        UInt32 count = size < 0x40000000 ? (UInt32)size : 0x40000000;
+        if (stream.Read(data, count, processed) != S_OK || processed == 0)
+            return false;
+        data = (char *)data + processed;
+        size -= processed;
+    }
+    return true;
+}
+
+static UInt64 ParseTarNumber(const unsigned char *field, int length) {
+    UInt64 value = 0;
+    if (field[0] & 0x80) {
+        // NOTE: GNU base-256 encoding for large values
+        for (int i = 1; i < length; i++)
+            value = (value << 8) | field[i];
+        return value;
+    }
+    while (length > 0 && *field == ' ')
+        field++, length--;
+    for (int i = 0; i < length && field[i] >= '0' && field[i] <= '7'; i++)
+        value = (value << 3) | (field[i] - '0');
+    return value;
+}
+
+static bool IsTarHeader(const unsigned char *header, UInt64 size) {
+    UInt64 checksum = 256; // the checksum field counts as spaces
+    for (int i = 0; i < 512; i++)
+        if (i < 148 || i >= 156)
+            checksum += header[i];
+    char type = header[156];
+    return checksum == ParseTarNumber(header + 148, 8)
+        && (type == '0' || type == '\0' || type == '7')
+        && size == ParseTarNumber(header + 124, 12);
+}
+
+bool SevenzipArchiveCmd::FindStoredData(sevenzip::Istream &input, int index, UInt64 &offset, UInt64 &size) {
+    // NOTE: only uncompressed and not encrypted data can be read as is,
+    // NOTE: the header in the archive must confirm what the handler reports
+    UInt64 position, packSize;
+    bool encrypted = false;
+    if (archive.getWideItemProperty(index, kpidOffset, position) != S_OK
+            || archive.getWideItemProperty(index, kpidSize, size) != S_OK)
+        return false;
+    if (archive.getBoolItemProperty(index, kpidEncrypted, encrypted) == S_OK && encrypted)
+        return false;
+    // NOTE: tar reports the pack size rounded up to its 512 byte blocks, the
+    // NOTE: size in the tar header is checked instead
+    if (archive.getWideItemProperty(index, kpidPackSize, packSize) != S_OK)
+        packSize = size;
+
+    unsigned char header[512];
+    // zip local file header: signature, flags at 6, method at 8, name and extra lengths at 26
+    if (ReadStreamAt(input, position, header, 30)
+            && memcmp(header, "PK\3\4", 4) == 0) {
+        UInt32 flags = header[6] | (header[7] << 8);
+        UInt32 method = header[8] | (header[9] << 8);
+        if (method != 0 || (flags & 1) || packSize != size)
+            return false;
+        offset = position + 30 + (header[26] | (header[27] << 8)) + (header[28] | (header[29] << 8));
+        return true;
+    }
+    // tar header, the handler reports either its position or the position of the data
+    for (int i = 0; i < 2; i++) {
+        UInt64 headerPosition = position - i * 512;
+        if (headerPosition > position)
+            break;
+        if (ReadStreamAt(input, headerPosition, header, 512) && IsTarHeader(header, size)) {
+            offset = headerPosition + 512;
+            return true;
         }
     }
+    return false;
+}
+
+int SevenzipArchiveCmd::Read(Tcl_Obj *source, Tcl_Obj *password, Tcl_WideInt offset, Tcl_WideInt length) {
+    DEBUGLOG(this << " SevenzipArchiveCmd::Read"
+            << " " << (source ? Tcl_GetString(source) : "NULL")
+            << " " << offset << " " << length);
+    int i = FindItem(Tcl_GetString(source));
+    while (i >= 0 && ItemIsDir(i))
+        i = FindNextItem(i);
+    if (i < 0) {
+        Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("no such item \"%s\" in the archive", Tcl_GetString(source)));
+        return TCL_ERROR;
+    }
+
+    Tcl_Obj *data = NULL;
+    HRESULT hr = S_OK;
+    UInt64 dataOffset, size;
+    // NOTE: stored data is read from a second stream of the archive, the
+    // NOTE: stream of an archive on a channel is read in place and its
+    // NOTE: position is restored for the next extraction
+    sevenzip::Istream *input = ReopenStream();
+    UInt64 position = 0;
+    if (!input && stream->Seek(0, SEEK_CUR, position) == S_OK)
+        input = stream;
+    if (input && FindStoredData(*input, i, dataOffset, size)) {
+        // NOTE: stored item, read the range without decoding
+        UInt64 count = (UInt64)offset < size ? size - offset : 0;
+        if (length >= 0 && (UInt64)length < count)
+            count = length;
+        data = Tcl_NewByteArrayObj(NULL, 0);
+        Tcl_IncrRefCount(data);
+        unsigned char *bytes = Tcl_SetByteArrayLength(data, (Tcl_Size)count);
+        hr = count == 0 || ReadStreamAt(*input, dataOffset + offset, bytes, count) ? S_OK : E_FAIL;
+    }
+    if (input == stream)
+        stream->Seek((Int64)position, SEEK_SET, position);
+    else if (input)
+        delete input;
+    if (!data) {
+        // NOTE: the decoded data comes with a reference of its own
+        hr = ExtractToObj(i, data, password, offset, length < 0 ? (UInt64)-1 : (UInt64)length);
+    }
+    if (hr != S_OK) {
+        if (data)
+            Tcl_DecrRefCount(data);
+        return lastError(tclInterp, hr);
+    }
+    Tcl_SetObjResult(tclInterp, data);
+    Tcl_DecrRefCount(data);
     return TCL_OK;
 }
 
-int SevenzipArchiveCmd::Extract(Tcl_Obj *source, Tcl_Obj *destination, Tcl_Obj *password, bool usechannel) {
+int SevenzipArchiveCmd::Extract(Tcl_Obj *source, Tcl_Obj *destination, Tcl_Obj *password,
+        bool usechannel, bool multithread, size_t buffersize, bool readahead) {
     DEBUGLOG(this << " SevenzipArchiveCmd::Extract"
             << " " << (source ? Tcl_GetString(source) : "NULL")
             << " " << (destination ? Tcl_GetString(destination) : "NULL")
             << " " << (password ? Tcl_GetString(password) : "NULL")
-            << " " << usechannel);
-    int result = TCL_OK;
-    unsigned int count = archive.getNumberOfItems();
-    if (count < 0)
+            << " " << usechannel << " " << multithread);
+    int i = FindItem(Tcl_GetString(source));
+    while (i >= 0 && ItemIsDir(i))
+        i = FindNextItem(i);
+    if (i < 0) {
+        Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("no such item \"%s\" in the archive", Tcl_GetString(source)));
         return TCL_ERROR;
-    unsigned int i;
-    for (i = 0; i < count; ++i) {
-        if (archive.getItemIsDir(i))
-            continue;            
+    }
+
+    SevenzipOutStream stream(tclInterp);
+    stream.SetBufferSize(buffersize);
+
+    HRESULT hr = usechannel
+        ? stream.AttachOpenChannel(destination)
+        : stream.AttachFileChannel(destination);
 
+    if (hr == S_OK) {
+        wchar_t buffer[1024];
+        hr = ExtractItems(stream, password 
+                ? sevenzip::fromBytes(buffer, sizeof(buffer)/sizeof(buffer[0]), Tcl_GetString(password)) : NULL,
+                i, multithread, readahead);
+    }
+
+    if (!usechannel) {
+        // NOTE: detach channel to 1) close it, and 2) enable SetXxxx functions.
+        Tcl_Close(tclInterp, stream.DetachChannel());
+
+        if (hr == S_OK) {
+            // NOTE: set file attrs that are not set for the attached channel
+            UInt32 time = archive.getItemTime(i);
+            UInt32 mode = archive.getItemMode(i);
+            UInt32 attr = archive.getItemAttr(i);
+            if (mode == 0 && (attr & 0x8000)) // unix 7zz/zip attr like  0x81a48020
+                mode = attr >> 16;
+            stream.SetMetadata(destination, time, mode,
+                    (attr & 0x7FFF) > 0 ? ((attr & 0x8000) ? (attr & 0x7FFF) : attr) : 0);
+        }
+    }
+
+    if (hr != S_OK)
+        return lastError(tclInterp, hr);
+    return TCL_OK;
+}
+
+int SevenzipArchiveCmd::ExtractAll(Tcl_Obj *directory, int patternc, Tcl_Obj *const patternv[],
+        char type, int flags, Tcl_Obj *password, bool multithread, size_t buffersize, bool readahead) {
+    DEBUGLOG(this << " SevenzipArchiveCmd::ExtractAll"
+            << " " << (directory ? Tcl_GetString(directory) : "NULL")
+            << " " << patternc << " " << type << " " << flags
+            << " " << (password ? Tcl_GetString(password) : "NULL")
+            << " " << multithread);
+    // NOTE: the selection is kept by item index, items that share a path are
+    // NOTE: selected one by one
+    int count = ItemCount();
+    const char **paths = (const char **)ckalloc((count + 1) * sizeof(const char *));
+    char *selected = (char *)ckalloc(count + 1);
+    int selectedCount = 0;
+    for (int i = 0; i < count; i++) {
+        paths[i] = ItemPath(i);
+        selected[i] = 0;
+        if (type == 'd' && !ItemIsDir(i))
+            continue;
+        if (type == 'f' && ItemIsDir(i))
+            continue;
+        const char *path = ItemPath(i);
+        if (!Path_IsSafe(path)) {
+            DEBUGLOG(this << " SevenzipArchiveCmd::ExtractAll skip unsafe " << (path ? path : "NULL"));
+            continue;
+        }
+        if (patternc > 0) {
+            int j;
+            for (j = 0; j < patternc; j++)
+                if (Path_Match(path, Tcl_GetString(patternv[j]), flags))
+                    break;
+            if (j >= patternc)
+                continue;
+        }
+        selected[i] = 1;
+        selectedCount++;
+    }
+
+    HRESULT hr = S_OK;
+    if (selectedCount > 0) {
+        SevenzipOutStream stream(tclInterp);
+        stream.SetDirectory(directory);
+        stream.SetBufferSize(buffersize);
+
+        wchar_t buffer[1024];
+        const wchar_t *passwordString = password 
+                ? sevenzip::fromBytes(buffer, sizeof(buffer)/sizeof(buffer[0]), Tcl_GetString(password)) : NULL;
+        bool solid = false;
+        if (archive.getBoolProperty(kpidSolid, solid) != S_OK)
+            solid = false;
+        if (selectedCount == count) {
+            hr = ExtractItems(stream, passwordString, -1, multithread, readahead);
+        } else if (solid) {
+            // NOTE: a solid block is decoded as a whole, all items are passed
+            // NOTE: in one pass and the stream skips the unselected ones, so
+            // NOTE: every block is decoded only once
+            stream.SetFilter(count, paths, selected);
+            hr = ExtractItems(stream, passwordString, -1, multithread, readahead);
+        } else {
+            // NOTE: items are decoded on their own, only the selected ones are read
+            for (int i = 0; i < count && hr == S_OK; i++)
+                if (selected[i])
+                    hr = ExtractItems(stream, passwordString, i, multithread, readahead);
+        }
+        stream.ApplyMetadata();
+    }
+    ckfree((char *)paths);
+    ckfree(selected);
+
+    if (hr != S_OK)
+        return lastError(tclInterp, hr);
+    return TCL_OK;
+}
+
+int SevenzipArchiveCmd::Mount(Tcl_Obj *mountpoint, Tcl_Obj *password) {
+    DEBUGLOG(this << " SevenzipArchiveCmd::Mount " << Tcl_GetString(mountpoint));
+    if (mount) {
+        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj("archive is already mounted", -1));
+        return TCL_ERROR;
+    }
+    mount = new SevenzipMount(this, password);
+    int count = ItemCount();
+    for (int i = 0; i < count; i++) {
+        const char *path = ItemPath(i);
+        UInt64 size = 0;
+        archive.getWideItemProperty(i, kpidSize, size);
+        UInt32 mode = archive.getItemMode(i);
+        UInt32 attr = archive.getItemAttr(i);
+        if (mode == 0 && (attr & 0x8000)) // unix 7zz/zip attr like  0x81a48020
+            mode = attr >> 16;
+        else if (mode == 0 && (attr & 0x0001)) // readonly
+            mode = 0444;
+        mount->AddItem(path, i, ItemIsDir(i), size, archive.getItemTime(i), mode);
+    }
+    if (mount->Mount(tclInterp, mountpoint) != TCL_OK) {
+        delete mount;
+        mount = NULL;
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+HRESULT SevenzipArchiveCmd::ExtractToObj(int index, Tcl_Obj *&data, Tcl_Obj *password,
+        UInt64 offset, UInt64 length) {
+    DEBUGLOG(this << " SevenzipArchiveCmd::ExtractToObj " << index << " " << offset << " " << length);
+    // NOTE: on success data holds a reference the caller has to release
+    data = Tcl_NewByteArrayObj(NULL, 0);
+    // NOTE: allocate the expected size up front, so the data is written
+    // NOTE: once and the byte array is not grown and copied while decoding
+    UInt64 size, packSize;
+    if (archive.getWideItemProperty(index, kpidSize, size) == S_OK) {
+        size = size > offset ? size - offset : 0;
+        if (size > length)
+            size = length;
+        if (size > EXTRACT_PRESIZE_MAX)
+            size = EXTRACT_PRESIZE_MAX;
+        // NOTE: items of solid blocks report no packed size of their own
+        if (archive.getWideItemProperty(index, kpidPackSize, packSize) == S_OK && packSize > 0
+                && size / EXTRACT_PRESIZE_RATIO > packSize)
+            size = packSize * EXTRACT_PRESIZE_RATIO;
+        Tcl_SetByteArrayLength(data, (Tcl_Size)size);
+    }
+    SevenzipOutStream stream(tclInterp);
+    HRESULT hr = stream.AttachObj(data, offset, length);
+    if (hr == S_OK) {
+        wchar_t buffer[1024];
+        hr = ExtractItems(stream, password 
+                ? sevenzip::fromBytes(buffer, sizeof(buffer)/sizeof(buffer[0]), Tcl_GetString(password)) : NULL,
+                index, false);
+        // NOTE: decoding is aborted as soon as the range is complete
+        if (stream.IsRangeDone())
+            hr = S_OK;
+        data = stream.DetachObj();
+    } else {
+        Tcl_IncrRefCount(data);
+    }
+    if (hr != S_OK) {
+        Tcl_DecrRefCount(data);
+        data = NULL;
+    }
+    return hr;
+}
+
+sevenzip::Istream *SevenzipArchiveCmd::CloneStream() {
+    // NOTE: a stream over the same memory is ready to use, a file
+    // NOTE: stream has to be opened with the archive file name
+    Tcl_Obj *data = stream->GetObj();
+    if (!data)
+        return stream->Clone();
+    SevenzipInStream *clone = new SevenzipInStream(tclInterp);
+    if (clone->AttachObj(data) != S_OK) {
+        delete clone;
+        return NULL;
+    }
+    return clone;
+}
+
+sevenzip::Istream *SevenzipArchiveCmd::ReopenStream() {
+    // NOTE: only archives on files and in memory can be opened a second time
+    if (!filename && !stream->GetObj())
+        return NULL;
+    sevenzip::Istream *input = CloneStream();
+    if (input && filename && input->Open(sevenzip::fromBytes(Tcl_GetString(filename))) != S_OK) {
+        delete input;
+        return NULL;
+    }
+    return input;
+}
+
+HRESULT SevenzipArchiveCmd::OpenChannel(int index, Tcl_Obj *password, Tcl_Channel &channel) {
+    DEBUGLOG(this << " SevenzipArchiveCmd::OpenChannel " << index);
+    channel = NULL;
+    // NOTE: archives on files and in memory can be opened a second time
+    bool reopenable = filename || stream->GetObj();
+    UInt64 dataOffset, size;
+    sevenzip::Istream *input = ReopenStream();
+    if (input) {
+        // NOTE: stored item, read it from a second stream of the archive
+        if (FindStoredData(*input, index, dataOffset, size)) {
+            channel = SevenzipRangeChannel_Create(input, dataOffset, size);
+            return S_OK;
+        }
+        delete input;
+    }
+    if (reopenable) {
+        // NOTE: decode on demand from a second instance of the archive
+        wchar_t openBuffer[1024];
+        wchar_t buffer[1024];
+        UInt64 size;
+        if (archive.getWideItemProperty(index, kpidSize, size) != S_OK)
+            size = (UInt64)-1;
+        SevenzipItemChannel *itemChannel = new SevenzipItemChannel(tclInterp);
+        HRESULT hr = itemChannel->Start(*lib, CloneStream(),
+                filename ? sevenzip::fromBytes(Tcl_GetString(filename)) : NULL,
+                this->password ? sevenzip::fromBytes(openBuffer, sizeof(openBuffer)/sizeof(openBuffer[0]),
+                        Tcl_GetString(this->password)) : NULL,
+                formatIndex,
+                password ? sevenzip::fromBytes(buffer, sizeof(buffer)/sizeof(buffer[0]),
+                        Tcl_GetString(password)) : NULL,
+                index, (Tcl_WideInt)size, channel);
+        if (hr == S_OK)
+            return S_OK;
+        delete itemChannel;
+        if (hr != E_NOTIMPL)
+            return hr;
+    }
+
+    // NOTE: archives on channels can not be opened twice, and without threads
+    // NOTE: there is nobody to decode on demand, use an in-memory copy
+    Tcl_Obj *data;
+    HRESULT hr = ExtractToObj(index, data, password);
+    if (hr != S_OK)
+        return hr;
+    channel = SevenzipMemoryChannel_Create(data);
+    Tcl_DecrRefCount(data);
+    return hr;
+}
+
+void SevenzipArchiveCmd::BuildItemPaths() {
+    DEBUGLOG(this << " SevenzipArchiveCmd::BuildItemPaths");
+    int count = archive.getNumberOfItems();
+    if (count < 0)
+        count = 0;
+    // NOTE: all paths are converted once and stored one after another in a
+    // NOTE: single block, itemPathOffset[i] is the start of the path of item i
+    size_t size = 0;
+    size_t capacity = 64 * (size_t)count + 1;
+    itemPaths = (char *)ckalloc(capacity);
+    itemPathOffset = (size_t *)ckalloc((count + 1) * sizeof(size_t));
+    itemIsDir = (char *)ckalloc(count + 1);
+    for (int i = 0; i < count; i++) {
 #ifdef _WIN32
-        char* path = Path_WindowsPathToUnixPath(sevenzip::toBytes(archive.getItemPath(i)));
+        char *path = Path_WindowsPathToUnixPath(sevenzip::toBytes(archive.getItemPath(i)));
 #else
-        char* path = sevenzip::toBytes(archive.getItemPath(i));
+        char *path = sevenzip::toBytes(archive.getItemPath(i));
 #endif
-        if (strcmp(path, Tcl_GetString(source)) == 0) {
-            SevenzipOutStream stream(tclInterp);
-
-            // NOTE: use single thread to avoid Tcl threading issues    
-            archive.addBoolOption(L"mt", false);
-
-            HRESULT hr = usechannel
-                ? stream.AttachOpenChannel(destination)
-                : stream.AttachFileChannel(destination);
-
-            if (hr == S_OK)
-                hr = archive.extract(stream, 
-                        password ? sevenzip::fromBytes(Tcl_GetString(password)) : NULL, i);
-
-            if (hr == E_NOINTERFACE) // looks like options are not supported, skip error
-                hr = archive.extract(stream, 
-                        password ? sevenzip::fromBytes(Tcl_GetString(password)) : NULL, i);
-
-            if (!usechannel) {
-                // NOTE: detach channel to 1) close it, and 2) enable SetXxxx functions.
-                Tcl_Close(tclInterp, stream.DetachChannel());
-
-                if (hr == S_OK) {
-                    // NOTE: set file attrs that are not set for the attached channel
-                    UInt32 time = archive.getItemTime(i);
-                    UInt32 mode = archive.getItemMode(i);
-                    UInt32 attr = archive.getItemAttr(i);
-                    if (time > 0)
-                        stream.SetTime(destination, time);
-                    if (mode > 0)
-                        stream.SetMode(destination, mode);
-                    else if (attr & 0x8000) // unix 7zz/zip attr like  0x81a48020
-                        stream.SetMode(destination, attr >> 16);
-                    if ((attr & 0x7FFF) > 0)
-                        stream.SetAttr(destination, (attr & 0x8000) ? (attr & 0x7FFF) : attr);
-                }
-            }
+        size_t length = path ? strlen(path) : 0;
+        if (size + length + 1 > capacity) {
+            while (size + length + 1 > capacity)
+                capacity *= 2;
+            itemPaths = (char *)ckrealloc(itemPaths, capacity);
+        }
+        if (length)
+            memcpy(itemPaths + size, path, length);
+        itemPaths[size + length] = '\0';
+        itemPathOffset[i] = size;
+        itemIsDir[i] = archive.getItemIsDir(i) ? 1 : 0;
+        size += length + 1;
+    }
+    itemCount = count;
+    itemPathsReady = true;
+}
 
-            if (hr != S_OK)
-                result = lastError(tclInterp, hr);
+const char *SevenzipArchiveCmd::ItemPath(int index) {
+    if (!itemPathsReady)
+        BuildItemPaths();
+    return index >= 0 && index < itemCount ? itemPaths + itemPathOffset[index] : "";
+}
 
-            break;
+bool SevenzipArchiveCmd::ItemIsDir(int index) {
+    if (!itemPathsReady)
+        BuildItemPaths();
+    return index >= 0 && index < itemCount && itemIsDir[index];
+}
+
+int SevenzipArchiveCmd::ItemCount() {
+    if (!itemPathsReady)
+        BuildItemPaths();
+    return itemCount;
+}
+
+int SevenzipArchiveCmd::CompareSortedItems(const void *a, const void *b) {
+    const SortedItem *x = (const SortedItem *)a;
+    const SortedItem *y = (const SortedItem *)b;
+    int result = strcmp(x->path, y->path);
+    return result ? result : x->index - y->index;
+}
+
+void SevenzipArchiveCmd::BuildSortedItems() {
+    DEBUGLOG(this << " SevenzipArchiveCmd::BuildSortedItems");
+    int count = ItemCount();
+    itemSorted = (SortedItem *)ckalloc((count + 1) * sizeof(SortedItem));
+    for (int i = 0; i < count; i++) {
+        itemSorted[i].path = ItemPath(i);
+        itemSorted[i].index = i;
+    }
+    qsort(itemSorted, count, sizeof(SortedItem), CompareSortedItems);
+}
+
+int SevenzipArchiveCmd::FindSortedItem(const char *path) {
+    if (!itemSorted)
+        BuildSortedItems();
+    // NOTE: first position with a path not less than the given one
+    int low = 0, high = ItemCount();
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (strcmp(itemSorted[middle].path, path) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+void SevenzipArchiveCmd::BuildItemIndex() {
+    DEBUGLOG(this << " SevenzipArchiveCmd::BuildItemIndex");
+    int count = ItemCount();
+    Tcl_InitHashTable(&itemIndex, TCL_STRING_KEYS);
+    itemNext = (int *)ckalloc((count + 1) * sizeof(int));
+    // NOTE: last item of the chain is stored in the slot of the first one
+    int *itemLast = (int *)ckalloc((count + 1) * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        int isNew;
+        Tcl_HashEntry *entry = Tcl_CreateHashEntry(&itemIndex, ItemPath(i), &isNew);
+        itemNext[i] = -1;
+        if (isNew) {
+            Tcl_SetHashValue(entry, (ClientData)(size_t)i);
+            itemLast[i] = i;
+        } else {
+            int first = (int)(size_t)Tcl_GetHashValue(entry);
+            itemNext[itemLast[first]] = i;
+            itemLast[first] = i;
         }
     }
-    if (i >= count) {
-        Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("no such item \"%s\" in the archive", Tcl_GetString(source)));
-        result = TCL_ERROR;
+    ckfree((char *)itemLast);
+    itemIndexReady = true;
+}
+
+void SevenzipArchiveCmd::ClearItemIndex() {
+    if (itemIndexReady) {
+        Tcl_DeleteHashTable(&itemIndex);
+        ckfree((char *)itemNext);
+        itemNext = NULL;
+        itemIndexReady = false;
+    }
+    if (itemSorted) {
+        ckfree((char *)itemSorted);
+        itemSorted = NULL;
+    }
+    if (itemPathsReady) {
+        ckfree(itemPaths);
+        ckfree((char *)itemPathOffset);
+        ckfree(itemIsDir);
+        itemPaths = NULL;
+        itemPathOffset = NULL;
+        itemIsDir = NULL;
+        itemCount = 0;
+        itemPathsReady = false;
     }
-    return result;
+}
+
+int SevenzipArchiveCmd::FindItem(const char *path) {
+    if (!itemIndexReady)
+        BuildItemIndex();
+    Tcl_HashEntry *entry = Tcl_FindHashEntry(&itemIndex, path);
+    return entry ? (int)(size_t)Tcl_GetHashValue(entry) : -1;
+}
+
+int SevenzipArchiveCmd::FindNextItem(int index) {
+    return itemIndexReady && index >= 0 ? itemNext[index] : -1;
 }
 
 static int Tcl_StringCaseEqual(const char *str1, const char *str2, int nocase) {
@@ -612,6 +1647,34 @@ static int Tcl_StringCaseEqual(const char *str1, const char *str2, int nocase) {
     return 0 == (nocase ? Tcl_UtfNcasecmp(str1, str2, len1) : Tcl_UtfNcmp(str1, str2, len1));
 }
 
+static int Path_Match(const char *path, const char *pattern, int flags) {
+    if (flags & LIST_MATCH_EXACT)
+        return Tcl_StringCaseEqual(path, pattern, flags & TCL_MATCH_NOCASE);
+    return Tcl_StringCaseMatch(path, pattern, flags & TCL_MATCH_NOCASE);
+}
+
+// NOTE: reject empty and absolute paths and paths going outside of the destination directory
+static int Path_IsSafe(const char *path) {
+    if (!path || !*path || *path == '/')
+        return 0;
+#ifdef _WIN32
+    if (*path == '\\' || path[1] == ':')
+        return 0;
+#   define PATH_ISSEPARATOR(_c_) ((_c_) == '/' || (_c_) == '\\')
+#else
+#   define PATH_ISSEPARATOR(_c_) ((_c_) == '/')
+#endif
+    for (const char *p = path; *p; ) {
+        const char *e = p;
+        while (*e && !PATH_ISSEPARATOR(*e))
+            e++;
+        if (e - p == 2 && p[0] == '.' && p[1] == '.')
+            return 0;
+        p = *e ? e + 1 : e;
+    }
+    return 1;
+}
+
 #ifdef _WIN32
 static char *Path_WindowsPathToUnixPath(char *path) {
     if (path)
@@ -2,6 +2,7 @@
 #define SEVENZIPARCHIVECMD_H
 
 #include "sevenzipstream.hpp"
+#include "sevenzipfs.hpp"
 
 #include "tclcmd.hpp"
 
@@ -17,14 +18,88 @@ public:
 
     void Close();
 
+    int Mount(Tcl_Obj *mountpoint, Tcl_Obj *password);
+    HRESULT ExtractToObj(int index, Tcl_Obj *&data, Tcl_Obj *password,
+            UInt64 offset = 0, UInt64 length = (UInt64)-1);
+    HRESULT OpenChannel(int index, Tcl_Obj *password, Tcl_Channel &channel);
+
 private:
 
     SevenzipInStream* stream = NULL;
+    SevenzipBridge bridge;
+    SevenzipBridgeInStream* bridgeStream = NULL;
     sevenzip::Iarchive archive;
+    SevenzipMount *mount = NULL;
+
+    // NOTE: set by the innermost running foreach, tells it the archive was closed
+    bool *deletedFlag = NULL;
+
+    // NOTE: to open the archive again for item channels
+    sevenzip::Lib *lib = NULL;
+    Tcl_Obj *filename = NULL;
+    Tcl_Obj *password = NULL;
+    int formatIndex = -1;
+
+    // path -> first item index, items with the same path are chained by itemNext
+    Tcl_HashTable itemIndex;
+    int *itemNext = NULL;
+    bool itemIndexReady = false;
+
+    // UTF-8 paths of the items with / separators, converted once per handle
+    char *itemPaths = NULL;
+    size_t *itemPathOffset = NULL;
+    char *itemIsDir = NULL;
+    int itemCount = 0;
+    bool itemPathsReady = false;
+
+    // items ordered by path, the items below a directory are adjacent
+    struct SortedItem {
+        const char *path;
+        int index;
+    };
+    SortedItem *itemSorted = NULL;
+
+    void BuildItemPaths();
+    const char *ItemPath(int index);
+    bool ItemIsDir(int index);
+    int ItemCount();
+    void BuildSortedItems();
+    int FindSortedItem(const char *path);
+    static int CompareSortedItems(const void *a, const void *b);
+    void BuildItemIndex();
+    void ClearItemIndex();
+    int FindItem(const char *path);
+    int FindNextItem(int index);
+
+    // NOTE: item property requested with -fields, type is VT_EMPTY when the format lacks it
+    struct ItemField {
+        PROPID id;
+        VARTYPE type;
+    };
+
+    // NOTE: shared property name objects of the interpreter, see PropertyKey
+    Tcl_Obj **propertyKeys = NULL;
 
+    Tcl_Obj *PropertyKey(PROPID propId);
     int Info(Tcl_Obj *info);
-    int List(Tcl_Obj *list, Tcl_Obj *pattern, char type, int flags, bool info);
-    int Extract(Tcl_Obj *source, Tcl_Obj *destination, Tcl_Obj *password, bool usechannel);
+    template <typename F> int EachItem(Tcl_Obj *pattern, Tcl_Obj *dir, char type, int flags, const F &func);
+    int ResolveFields(Tcl_Obj *fields, int &fieldc, ItemField *&fieldv);
+    int List(Tcl_Obj *list, Tcl_Obj *pattern, char type, int flags, bool info, Tcl_Obj *fields = NULL,
+            Tcl_Obj *dir = NULL);
+    int Foreach(Tcl_Obj *varName, Tcl_Obj *pattern, char type, int flags, bool info, Tcl_Obj *fields,
+            Tcl_Obj *dir, Tcl_Obj *body);
+    Tcl_Obj *PropertyObj(int index, PROPID propId, VARTYPE propType);
+    Tcl_Obj *ItemObj(int index, const char *path, bool info, int fieldc = 0, const ItemField *fieldv = NULL);
+    sevenzip::Istream *CloneStream();
+    sevenzip::Istream *ReopenStream();
+    bool FindStoredData(sevenzip::Istream &input, int index, UInt64 &offset, UInt64 &size);
+    int Read(Tcl_Obj *source, Tcl_Obj *password, Tcl_WideInt offset, Tcl_WideInt length);
+    HRESULT ExtractItems(sevenzip::Ostream &stream, const wchar_t *password, int index, bool multithread,
+            bool readahead = false);
+    int Extract(Tcl_Obj *source, Tcl_Obj *destination, Tcl_Obj *password, bool usechannel, bool multithread,
+            size_t buffersize, bool readahead);
+    int ExtractAll(Tcl_Obj *directory, int patternc, Tcl_Obj *const patternv[],
+            char type, int flags, Tcl_Obj *password, bool multithread, size_t buffersize, bool readahead);
 
     virtual int Command (int objc, Tcl_Obj * const objv[]);
     virtual void Cleanup();
@@ -0,0 +1,939 @@
+#include "sevenzipchannel.hpp"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+
+#if defined(SEVENZIPCHANNEL_DEBUG)
+#   include <iostream>
+#   define DEBUGLOG(_x_) (std::wcerr << "DEBUG: " << _x_ << "\n")
+#else
+#   define DEBUGLOG(_x_)
+#endif
+
+// NOTE: read-only channel over the bytes of a Tcl_Obj or over a range of
+// NOTE: an input stream, no decoding is involved
+
+struct SevenzipMemoryChannel {
+    Tcl_Channel channel;
+    Tcl_Obj *data;
+    sevenzip::Istream *stream;
+    UInt64 offset;
+    Tcl_WideInt length;
+    Tcl_WideInt position;
+    Tcl_TimerToken timer;
+};
+
+static Tcl_Channel MemoryChannel_Create(Tcl_Obj *data, sevenzip::Istream *stream,
+        UInt64 offset, Tcl_WideInt length);
+
+static int MemoryChannel_Close(ClientData instanceData, Tcl_Interp *interp, int flags);
+static int MemoryChannel_Input(ClientData instanceData, char *buf, int toRead, int *errorCodePtr);
+static int MemoryChannel_Output(ClientData instanceData, const char *buf, int toWrite, int *errorCodePtr);
+static Tcl_WideInt MemoryChannel_WideSeek(ClientData instanceData, Tcl_WideInt offset, int mode, int *errorCodePtr);
+#if TCL_MAJOR_VERSION < 9
+static int MemoryChannel_Seek(ClientData instanceData, long offset, int mode, int *errorCodePtr);
+#endif
+static void MemoryChannel_Watch(ClientData instanceData, int mask);
+static void MemoryChannel_Timer(ClientData instanceData);
+static int MemoryChannel_GetHandle(ClientData instanceData, int direction, ClientData *handlePtr);
+static int MemoryChannel_BlockMode(ClientData instanceData, int mode);
+
+static const Tcl_ChannelType MemoryChannelType = {
+    "sevenzip",
+    TCL_CHANNEL_VERSION_5,
+#if TCL_MAJOR_VERSION < 9
+    TCL_CLOSE2PROC,
+#else
+    NULL,
+#endif
+    MemoryChannel_Input,
+    MemoryChannel_Output,
+#if TCL_MAJOR_VERSION < 9
+    MemoryChannel_Seek,
+#else
+    NULL,
+#endif
+    NULL,
+    NULL,
+    MemoryChannel_Watch,
+    MemoryChannel_GetHandle,
+    MemoryChannel_Close,
+    MemoryChannel_BlockMode,
+    NULL,
+    NULL,
+    MemoryChannel_WideSeek,
+    NULL,
+    NULL
+};
+
+const Tcl_ChannelType SevenzipItemChannel::channelType = {
+    "sevenzip",
+    TCL_CHANNEL_VERSION_5,
+#if TCL_MAJOR_VERSION < 9
+    TCL_CLOSE2PROC,
+#else
+    NULL,
+#endif
+    ChannelInput,
+    ChannelOutput,
+#if TCL_MAJOR_VERSION < 9
+    ChannelSeek,
+#else
+    NULL,
+#endif
+    NULL,
+    NULL,
+    ChannelWatch,
+    ChannelGetHandle,
+    ChannelClose,
+    ChannelBlockMode,
+    NULL,
+    NULL,
+    ChannelWideSeek,
+    NULL,
+    NULL
+};
+
+const Tcl_ChannelType SevenzipEncoderChannel::channelType = {
+    "sevenzip",
+    TCL_CHANNEL_VERSION_5,
+#if TCL_MAJOR_VERSION < 9
+    TCL_CLOSE2PROC,
+#else
+    NULL,
+#endif
+    ChannelInput,
+    ChannelOutput,
+    NULL,
+    NULL,
+    NULL,
+    ChannelWatch,
+    ChannelGetHandle,
+    ChannelClose,
+    ChannelBlockMode,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+Tcl_Channel SevenzipMemoryChannel_Create(Tcl_Obj *data) {
+    Tcl_Size length;
+    Tcl_GetByteArrayFromObj(data, &length);
+    return MemoryChannel_Create(data, NULL, 0, length);
+}
+
+Tcl_Channel SevenzipRangeChannel_Create(sevenzip::Istream *stream, UInt64 offset, UInt64 length) {
+    return MemoryChannel_Create(NULL, stream, offset, (Tcl_WideInt)length);
+}
+
+static Tcl_Channel MemoryChannel_Create(Tcl_Obj *data, sevenzip::Istream *stream,
+        UInt64 offset, Tcl_WideInt length) {
+    SevenzipMemoryChannel *chan = (SevenzipMemoryChannel *)ckalloc(sizeof(SevenzipMemoryChannel));
+    if (data)
+        Tcl_IncrRefCount(data);
+    chan->data = data;
+    chan->stream = stream;
+    chan->offset = offset;
+    chan->length = length;
+    chan->position = 0;
+    chan->timer = NULL;
+    char name[64];
+    snprintf(name, sizeof(name), "sevenzip%p", (void *)chan);
+    chan->channel = Tcl_CreateChannel(&MemoryChannelType, name, chan, TCL_READABLE);
+    return chan->channel;
+}
+
+static int MemoryChannel_Close(ClientData instanceData, Tcl_Interp *interp, int flags) {
+    SevenzipMemoryChannel *chan = (SevenzipMemoryChannel *)instanceData;
+    if (flags & (TCL_CLOSE_READ | TCL_CLOSE_WRITE))
+        return EINVAL;
+    if (chan->timer)
+        Tcl_DeleteTimerHandler(chan->timer);
+    if (chan->data)
+        Tcl_DecrRefCount(chan->data);
+    if (chan->stream)
+        delete chan->stream;
+    ckfree((char *)chan);
+    return 0;
+}
+
+static int MemoryChannel_Input(ClientData instanceData, char *buf, int toRead, int *errorCodePtr) {
+    SevenzipMemoryChannel *chan = (SevenzipMemoryChannel *)instanceData;
+    if (chan->position >= chan->length)
+        return 0;
+    if (toRead > chan->length - chan->position)
+        toRead = (int)(chan->length - chan->position);
+    if (chan->data) {
+        memcpy(buf, Tcl_GetByteArrayFromObj(chan->data, NULL) + chan->position, toRead);
+        chan->position += toRead;
+        return toRead;
+    }
+    // NOTE: the item is stored as is, read it straight from the archive
+    UInt64 position;
+    UInt32 processed = 0;
+    HRESULT hr = chan->stream->Seek(chan->offset + chan->position, SEEK_SET, position);
+    if (hr == S_OK)
+        hr = chan->stream->Read(buf, (UInt32)toRead, processed);
+    if (hr != S_OK) {
+        *errorCodePtr = EIO;
+        return -1;
+    }
+    chan->position += processed;
+    return (int)processed;
+}
+
+static int MemoryChannel_Output(ClientData instanceData, const char *buf, int toWrite, int *errorCodePtr) {
+    *errorCodePtr = EROFS;
+    return -1;
+}
+
+static Tcl_WideInt MemoryChannel_WideSeek(ClientData instanceData, Tcl_WideInt offset, int mode, int *errorCodePtr) {
+    SevenzipMemoryChannel *chan = (SevenzipMemoryChannel *)instanceData;
+    Tcl_WideInt base = mode == SEEK_CUR ? chan->position : mode == SEEK_END ? chan->length : 0;
+    if (base + offset < 0) {
+        *errorCodePtr = EINVAL;
+        return -1;
+    }
+    chan->position = base + offset;
+    return chan->position;
+}
+
+#if TCL_MAJOR_VERSION < 9
+static int MemoryChannel_Seek(ClientData instanceData, long offset, int mode, int *errorCodePtr) {
+    return (int)MemoryChannel_WideSeek(instanceData, offset, mode, errorCodePtr);
+}
+#endif
+
+static void MemoryChannel_Watch(ClientData instanceData, int mask) {
+    SevenzipMemoryChannel *chan = (SevenzipMemoryChannel *)instanceData;
+    // NOTE: reads never block, the channel is always readable
+    if (mask & TCL_READABLE) {
+        if (!chan->timer)
+            chan->timer = Tcl_CreateTimerHandler(0, MemoryChannel_Timer, chan);
+    } else if (chan->timer) {
+        Tcl_DeleteTimerHandler(chan->timer);
+        chan->timer = NULL;
+    }
+}
+
+static void MemoryChannel_Timer(ClientData instanceData) {
+    SevenzipMemoryChannel *chan = (SevenzipMemoryChannel *)instanceData;
+    chan->timer = NULL;
+    Tcl_NotifyChannel(chan->channel, TCL_READABLE);
+}
+
+static int MemoryChannel_GetHandle(ClientData instanceData, int direction, ClientData *handlePtr) {
+    return TCL_ERROR;
+}
+
+static int MemoryChannel_BlockMode(ClientData instanceData, int mode) {
+    return 0;
+}
+
+SevenzipItemChannel::SevenzipItemChannel(Tcl_Interp *interp, size_t bufferSize, size_t windowSize):
+        tclInterp(interp), tclChannel(NULL), input(NULL), archive(), password(NULL), index(-1), size(-1),
+        buffer(NULL), bufferSize(bufferSize), windowSize(windowSize), capacity(0),
+        bufferStart(0), bufferEnd(0), position(0),
+        closing(false), nonblocking(false), timer(NULL), watchMask(0), started(false) {
+    DEBUGLOG(this << " SevenzipItemChannel");
+}
+
+SevenzipItemChannel::~SevenzipItemChannel() {
+    DEBUGLOG(this << " ~SevenzipItemChannel");
+    if (timer)
+        Tcl_DeleteTimerHandler(timer);
+    Stop();
+    archive.close();
+    if (input)
+        delete input;
+    if (password)
+        ckfree((char *)password);
+    if (buffer)
+        ckfree(buffer);
+}
+
+HRESULT SevenzipItemChannel::Start(sevenzip::Lib &lib, sevenzip::Istream *stream, const wchar_t *filename,
+        const wchar_t *openPassword, int formatIndex, const wchar_t *password, int index,
+        Tcl_WideInt size, Tcl_Channel &channel, Tcl_Channel parent) {
+    DEBUGLOG(this << " SevenzipItemChannel::Start " << (filename ? filename : L"NULL") << " " << index);
+    channel = NULL;
+    if (!stream)
+        return E_FAIL;
+    // NOTE: the item is decoded by its own archive object, so the handle
+    // NOTE: stays usable while the channel is open
+    input = new SevenzipBridgeInStream(&bridge, stream, true);
+    if (parent) {
+        // NOTE: input buffered by the parent is handed to the transform when
+        // NOTE: it is stacked, so the archive is opened after that
+        tclChannel = Tcl_StackChannel(tclInterp, &channelType, this, TCL_READABLE, parent);
+        if (!tclChannel)
+            return E_FAIL;
+    }
+    HRESULT hr = Begin(lib, filename, openPassword, formatIndex, password, index, size);
+    if (hr != S_OK) {
+        // NOTE: the channel is not started yet, unstacking does not delete it
+        if (parent)
+            Tcl_UnstackChannel(tclInterp, tclChannel);
+        tclChannel = NULL;
+        return hr;
+    }
+
+    if (!parent) {
+        char name[64];
+        snprintf(name, sizeof(name), "sevenzip%p", (void *)this);
+        tclChannel = Tcl_CreateChannel(&channelType, name, this, TCL_READABLE);
+    }
+    started = true;
+    channel = tclChannel;
+    return S_OK;
+}
+
+HRESULT SevenzipItemChannel::Begin(sevenzip::Lib &lib, const wchar_t *filename, const wchar_t *openPassword,
+        int formatIndex, const wchar_t *password, int index, Tcl_WideInt size) {
+    HRESULT hr = archive.open(lib, *input, filename, openPassword, formatIndex);
+    if (hr != S_OK)
+        return hr;
+    if (password) {
+        size_t length = (wcslen(password) + 1) * sizeof(wchar_t);
+        this->password = (wchar_t *)ckalloc(length);
+        memcpy(this->password, password, length);
+    }
+    this->index = index;
+    this->size = size;
+    // NOTE: small items are kept completely, seeks never decode them again
+    capacity = bufferSize + windowSize;
+    if (size >= 0 && (Tcl_WideInt)capacity > size)
+        capacity = (size_t)size + 1;
+    if (bufferSize > capacity)
+        bufferSize = capacity;
+    buffer = (char *)ckalloc(capacity);
+    if (!bridge.Start(ExtractProc, this))
+        return E_NOTIMPL;
+    return S_OK;
+}
+
+void SevenzipItemChannel::Stop() {
+    // NOTE: stop the writer and serve the worker until it is done
+    bridge.Lock();
+    closing = true;
+    bridge.Notify();
+    bridge.Unlock();
+    bridge.Join();
+}
+
+HRESULT SevenzipItemChannel::Restart() {
+    DEBUGLOG(this << " SevenzipItemChannel::Restart");
+    Stop();
+    closing = false;
+    bufferStart = bufferEnd = position = 0;
+    return bridge.Start(ExtractProc, this) ? S_OK : E_FAIL;
+}
+
+HRESULT SevenzipItemChannel::ExtractProc(void *clientData) {
+    SevenzipItemChannel *channel = (SevenzipItemChannel *)clientData;
+    // NOTE: codec threads are allowed, all stream calls go through the bridge
+    channel->archive.addBoolOption(L"mt", true);
+    HRESULT hr = channel->archive.extract(*channel, channel->password, channel->index);
+    if (hr == E_NOINTERFACE) // looks like options are not supported, skip error
+        hr = channel->archive.extract(*channel, channel->password, channel->index);
+    return hr;
+}
+
+HRESULT SevenzipItemChannel::Open(const wchar_t *filename) {
+    return S_OK;
+}
+
+HRESULT SevenzipItemChannel::Write(const void *data, UInt32 size, UInt32 &processed) {
+    processed = 0;
+    bridge.Lock();
+    while (processed < size) {
+        // NOTE: decode at most bufferSize bytes ahead of the reader
+        while (bufferEnd - position >= (Tcl_WideInt)bufferSize && !closing)
+            bridge.Wait();
+        if (closing) {
+            bridge.Unlock();
+            return E_ABORT;
+        }
+        size_t offset = (size_t)(bufferEnd % capacity);
+        size_t count = size - processed;
+        if (count > bufferSize - (size_t)(bufferEnd - position))
+            count = bufferSize - (size_t)(bufferEnd - position);
+        if (count > capacity - offset)
+            count = capacity - offset;
+        memcpy(buffer + offset, (const char *)data + processed, count);
+        bufferEnd += count;
+        // NOTE: the oldest data of the window is overwritten
+        if (bufferEnd - bufferStart > (Tcl_WideInt)capacity)
+            bufferStart = bufferEnd - capacity;
+        processed += (UInt32)count;
+        bridge.Notify();
+    }
+    bridge.Unlock();
+    return S_OK;
+}
+
+HRESULT SevenzipItemChannel::Seek(Int64 offset, UInt32 origin, UInt64 &position) {
+    return E_NOTIMPL;
+}
+
+void SevenzipItemChannel::Close() {
+}
+
+HRESULT SevenzipItemChannel::Mkdir(const wchar_t* pathname) {
+    return S_OK;
+}
+
+HRESULT SevenzipItemChannel::SetMode(const wchar_t* pathname, UInt32 mode) {
+    return S_OK;
+}
+
+HRESULT SevenzipItemChannel::SetAttr(const wchar_t* pathname, UInt32 attr) {
+    return S_OK;
+}
+
+HRESULT SevenzipItemChannel::SetTime(const wchar_t* pathname, UInt32 time) {
+    return S_OK;
+}
+
+int SevenzipItemChannel::WaitData(int *errorCodePtr) {
+    // NOTE: called with the bridge locked, returns 0 at the end of data
+    while (position == bufferEnd && bridge.IsRunning()) {
+        if (bridge.Serve())
+            continue;
+        if (nonblocking) {
+            *errorCodePtr = EAGAIN;
+            return -1;
+        }
+        bridge.Wait();
+    }
+    return position < bufferEnd;
+}
+
+int SevenzipItemChannel::ChannelClose(ClientData instanceData, Tcl_Interp *interp, int flags) {
+    SevenzipItemChannel *channel = (SevenzipItemChannel *)instanceData;
+    if (flags & (TCL_CLOSE_READ | TCL_CLOSE_WRITE))
+        return EINVAL;
+    if (!channel->started)
+        return 0;
+    delete channel;
+    return 0;
+}
+
+int SevenzipItemChannel::ChannelInput(ClientData instanceData, char *buf, int toRead, int *errorCodePtr) {
+    SevenzipItemChannel *channel = (SevenzipItemChannel *)instanceData;
+    SevenzipBridge &bridge = channel->bridge;
+    bridge.Lock();
+    int ready = channel->WaitData(errorCodePtr);
+    if (ready < 0) {
+        bridge.Unlock();
+        return -1;
+    }
+    size_t offset = (size_t)(channel->position % channel->capacity);
+    size_t count = (size_t)toRead;
+    if (count > (size_t)(channel->bufferEnd - channel->position))
+        count = (size_t)(channel->bufferEnd - channel->position);
+    if (count > channel->capacity - offset)
+        count = channel->capacity - offset;
+    memcpy(buf, channel->buffer + offset, count);
+    channel->position += count;
+    if (count > 0)
+        bridge.Notify();
+    bridge.Unlock();
+
+    if (count == 0 && toRead > 0) {
+        // NOTE: the worker is done, report its errors at the end of data
+        HRESULT hr = bridge.Join();
+        if (hr != S_OK) {
+            DEBUGLOG(channel << " SevenzipItemChannel::ChannelInput error " << hr);
+            *errorCodePtr = EIO;
+            return -1;
+        }
+    }
+    return (int)count;
+}
+
+int SevenzipItemChannel::ChannelOutput(ClientData instanceData, const char *buf, int toWrite, int *errorCodePtr) {
+    *errorCodePtr = EROFS;
+    return -1;
+}
+
+Tcl_WideInt SevenzipItemChannel::ChannelWideSeek(ClientData instanceData, Tcl_WideInt offset, int mode, int *errorCodePtr) {
+    SevenzipItemChannel *channel = (SevenzipItemChannel *)instanceData;
+    SevenzipBridge &bridge = channel->bridge;
+    if (mode == SEEK_CUR)
+        offset += channel->position;
+    else if (mode == SEEK_END && channel->size >= 0)
+        offset += channel->size;
+    else if (mode != SEEK_SET) {
+        *errorCodePtr = EINVAL;
+        return -1;
+    }
+    if (offset < 0) {
+        *errorCodePtr = EINVAL;
+        return -1;
+    }
+
+    bridge.Lock();
+    if (offset < channel->bufferStart) {
+        // NOTE: the data is out of the window, decode again from the start
+        bridge.Unlock();
+        if (channel->Restart() != S_OK) {
+            *errorCodePtr = EIO;
+            return -1;
+        }
+        bridge.Lock();
+    }
+    // NOTE: move inside the window, skip forward as the data is decoded
+    for (;;) {
+        channel->position = offset < channel->bufferEnd ? offset : channel->bufferEnd;
+        bridge.Notify();
+        if (channel->position == offset)
+            break;
+        int ready = channel->WaitData(errorCodePtr);
+        if (ready < 0) {
+            bridge.Unlock();
+            return -1;
+        }
+        if (ready == 0)
+            break;
+    }
+    bridge.Unlock();
+    return channel->position;
+}
+
+#if TCL_MAJOR_VERSION < 9
+int SevenzipItemChannel::ChannelSeek(ClientData instanceData, long offset, int mode, int *errorCodePtr) {
+    return (int)ChannelWideSeek(instanceData, offset, mode, errorCodePtr);
+}
+#endif
+
+void SevenzipItemChannel::ChannelWatch(ClientData instanceData, int mask) {
+    SevenzipItemChannel *channel = (SevenzipItemChannel *)instanceData;
+    channel->watchMask = mask & TCL_READABLE;
+    if (channel->watchMask) {
+        if (!channel->timer)
+            channel->timer = Tcl_CreateTimerHandler(0, ChannelTimer, channel);
+    } else if (channel->timer) {
+        Tcl_DeleteTimerHandler(channel->timer);
+        channel->timer = NULL;
+    }
+}
+
+void SevenzipItemChannel::ChannelTimer(ClientData instanceData) {
+    SevenzipItemChannel *channel = (SevenzipItemChannel *)instanceData;
+    SevenzipBridge &bridge = channel->bridge;
+    channel->timer = NULL;
+    // NOTE: the worker may wait for its stream calls, serve them from the event loop
+    bridge.Lock();
+    while (bridge.Serve())
+        ;
+    bool ready = channel->position < channel->bufferEnd || !bridge.IsRunning();
+    bridge.Unlock();
+    if (ready)
+        Tcl_NotifyChannel(channel->tclChannel, TCL_READABLE);
+    else if (channel->watchMask)
+        channel->timer = Tcl_CreateTimerHandler(1, ChannelTimer, channel);
+}
+
+int SevenzipItemChannel::ChannelGetHandle(ClientData instanceData, int direction, ClientData *handlePtr) {
+    return TCL_ERROR;
+}
+
+int SevenzipItemChannel::ChannelBlockMode(ClientData instanceData, int mode) {
+    SevenzipItemChannel *channel = (SevenzipItemChannel *)instanceData;
+    channel->nonblocking = (mode == TCL_MODE_NONBLOCKING);
+    return 0;
+}
+
+// NOTE: the driver of the parent is used directly, Tcl_Seek on it would
+// NOTE: end up in the transform stacked on top
+static Tcl_WideInt ParentSeek(Tcl_Channel parent, Tcl_WideInt offset, int mode) {
+    const Tcl_ChannelType *type = Tcl_GetChannelType(parent);
+    ClientData instanceData = Tcl_GetChannelInstanceData(parent);
+    int errorCode = 0;
+    Tcl_DriverWideSeekProc *wideSeekProc = Tcl_ChannelWideSeekProc(type);
+    if (wideSeekProc)
+        return wideSeekProc(instanceData, offset, mode, &errorCode);
+#if TCL_MAJOR_VERSION < 9
+    Tcl_DriverSeekProc *seekProc = Tcl_ChannelSeekProc(type);
+    if (seekProc)
+        return seekProc(instanceData, (long)offset, mode, &errorCode);
+#endif
+    return -1;
+}
+
+SevenzipStackedInStream::SevenzipStackedInStream(Tcl_Channel parent):
+        parent(parent), base(0), position(0), seekable(false), moved(true),
+        spool(NULL), spoolSize(0), spoolCapacity(0), spoolDone(false) {
+    // NOTE: input buffered by Tcl is not counted as read yet
+    base = Tcl_Tell(parent);
+    seekable = base >= 0;
+    DEBUGLOG(this << " SevenzipStackedInStream base " << base);
+}
+
+SevenzipStackedInStream::~SevenzipStackedInStream() {
+    DEBUGLOG(this << " ~SevenzipStackedInStream");
+    if (spool)
+        ckfree(spool);
+}
+
+HRESULT SevenzipStackedInStream::Open(const wchar_t *filename) {
+    return S_OK;
+}
+
+HRESULT SevenzipStackedInStream::Read(void* data, UInt32 size, UInt32 &processed) {
+    processed = 0;
+    if (seekable) {
+        if (moved && ParentSeek(parent, base + (Tcl_WideInt)position, SEEK_SET) < 0)
+            return E_FAIL;
+        moved = false;
+        int errorCode = 0;
+        int result = Tcl_ChannelInputProc(Tcl_GetChannelType(parent))(
+                Tcl_GetChannelInstanceData(parent), (char *)data, (int)size, &errorCode);
+        if (result < 0)
+            return E_FAIL;
+        processed = (UInt32)result;
+        position += processed;
+        return S_OK;
+    }
+    if (!fillSpool(position + size))
+        return E_FAIL;
+    if (position < spoolSize) {
+        processed = (UInt32)(spoolSize - position < size ? spoolSize - position : size);
+        memcpy(data, spool + position, processed);
+        position += processed;
+    }
+    return S_OK;
+}
+
+HRESULT SevenzipStackedInStream::Seek(Int64 offset, UInt32 origin, UInt64 &position) {
+    Int64 target = offset;
+    if (origin == SEEK_CUR)
+        target += (Int64)this->position;
+    else if (origin == SEEK_END) {
+        if (seekable) {
+            Tcl_WideInt end = ParentSeek(parent, 0, SEEK_END);
+            if (end < 0)
+                return E_FAIL;
+            target += end - base;
+        } else {
+            // NOTE: the end is only known once everything is read
+            if (!fillSpool((UInt64)-1))
+                return E_FAIL;
+            target += (Int64)spoolSize;
+        }
+    } else if (origin != SEEK_SET)
+        return E_INVALIDARG;
+    if (target < 0)
+        return E_FAIL;
+    position = this->position = (UInt64)target;
+    moved = true;
+    return S_OK;
+}
+
+void SevenzipStackedInStream::Close() {
+}
+
+sevenzip::Istream *SevenzipStackedInStream::Clone() const {
+    return NULL;
+}
+
+bool SevenzipStackedInStream::IsDir(const wchar_t *pathname) {
+    return false;
+}
+
+UInt64 SevenzipStackedInStream::GetSize(const wchar_t *pathname) {
+    return 0;
+}
+
+UInt32 SevenzipStackedInStream::GetMode(const wchar_t *pathname) {
+    return 0;
+}
+
+UInt32 SevenzipStackedInStream::GetAttr(const wchar_t *pathname) {
+    return 0;
+}
+
+UInt32 SevenzipStackedInStream::GetTime(const wchar_t *pathname) {
+    return 0;
+}
+
+bool SevenzipStackedInStream::fillSpool(UInt64 end) {
+    while (!spoolDone && spoolSize < end) {
+        if (spoolSize == spoolCapacity) {
+            spoolCapacity = spoolCapacity ? spoolCapacity * 2 : 64 * 1024;
+            spool = (char *)ckrealloc(spool, spoolCapacity);
+        }
+        // NOTE: reads the input that Tcl buffered before the transform first
+        Tcl_Size result = Tcl_ReadRaw(parent, spool + spoolSize, (Tcl_Size)(spoolCapacity - spoolSize));
+        if (result < 0)
+            return false;
+        if (result == 0)
+            spoolDone = true;
+        spoolSize += (size_t)result;
+    }
+    return true;
+}
+
+HRESULT SevenzipStackedOutStream::Open(const wchar_t *filename) {
+    return S_OK;
+}
+
+HRESULT SevenzipStackedOutStream::Write(const void *data, UInt32 size, UInt32 &processed) {
+    processed = 0;
+    Tcl_Size result = Tcl_WriteRaw(parent, (const char *)data, (Tcl_Size)size);
+    if (result < 0)
+        return E_FAIL;
+    processed = (UInt32)result;
+    position += processed;
+    return S_OK;
+}
+
+HRESULT SevenzipStackedOutStream::Seek(Int64 offset, UInt32 origin, UInt64 &position) {
+    // NOTE: the output is written front to back, only the position can be asked for
+    Int64 target = origin == SEEK_SET ? offset : (Int64)this->position + offset;
+    if (origin == SEEK_END || target != (Int64)this->position)
+        return E_FAIL;
+    position = this->position;
+    return S_OK;
+}
+
+void SevenzipStackedOutStream::Close() {
+}
+
+HRESULT SevenzipStackedOutStream::Mkdir(const wchar_t* pathname) {
+    return S_OK;
+}
+
+HRESULT SevenzipStackedOutStream::SetMode(const wchar_t* pathname, UInt32 mode) {
+    return S_OK;
+}
+
+HRESULT SevenzipStackedOutStream::SetAttr(const wchar_t* pathname, UInt32 attr) {
+    return S_OK;
+}
+
+HRESULT SevenzipStackedOutStream::SetTime(const wchar_t* pathname, UInt32 time) {
+    return S_OK;
+}
+
+SevenzipEncoderChannel::SevenzipEncoderChannel(Tcl_Interp *interp, Tcl_Channel parent, size_t bufferSize):
+        tclInterp(interp), tclChannel(NULL), parent(parent),
+        output(parent), bridgeOutput(&bridge, &output), archive(), time(0),
+        buffer(NULL), bufferSize(bufferSize), bufferStart(0), bufferEnd(0), closing(false),
+        nonblocking(false), started(false) {
+    DEBUGLOG(this << " SevenzipEncoderChannel");
+}
+
+SevenzipEncoderChannel::~SevenzipEncoderChannel() {
+    DEBUGLOG(this << " ~SevenzipEncoderChannel");
+    // NOTE: the encoder sees the end of data and is served until it is done
+    bridge.Lock();
+    closing = true;
+    bridge.Notify();
+    bridge.Unlock();
+    bridge.Join();
+    if (buffer)
+        ckfree(buffer);
+}
+
+HRESULT SevenzipEncoderChannel::Create(sevenzip::Lib &lib, int formatIndex) {
+    DEBUGLOG(this << " SevenzipEncoderChannel::Create " << formatIndex);
+    Tcl_Time now;
+    Tcl_GetTime(&now);
+    time = (UInt32)now.sec;
+    HRESULT hr = archive.open(lib, *this, bridgeOutput, NULL, NULL, formatIndex);
+    if (hr != S_OK)
+        return hr;
+    // NOTE: formats that store the name of the data get this one
+    archive.addItem(L"data");
+    return S_OK;
+}
+
+HRESULT SevenzipEncoderChannel::Start(Tcl_Channel &channel) {
+    DEBUGLOG(this << " SevenzipEncoderChannel::Start");
+    channel = NULL;
+    buffer = (char *)ckalloc(bufferSize);
+    // NOTE: the encoder writes to the parent, it is started only when the
+    // NOTE: transform is stacked and the channel is handed to the caller
+    tclChannel = Tcl_StackChannel(tclInterp, &channelType, this, TCL_WRITABLE, parent);
+    if (!tclChannel)
+        return E_FAIL;
+    if (!bridge.Start(EncodeProc, this)) {
+        // NOTE: the channel is not started yet, unstacking does not delete it
+        Tcl_UnstackChannel(tclInterp, tclChannel);
+        tclChannel = NULL;
+        return E_NOTIMPL;
+    }
+    started = true;
+    channel = tclChannel;
+    return S_OK;
+}
+
+HRESULT SevenzipEncoderChannel::EncodeProc(void *clientData) {
+    SevenzipEncoderChannel *channel = (SevenzipEncoderChannel *)clientData;
+    // NOTE: codec threads are allowed, they read the ring buffer directly
+    channel->archive.addBoolOption(L"mt", true);
+    HRESULT hr = channel->archive.update();
+    if (hr == E_NOINTERFACE) // looks like options are not supported, skip error
+        hr = channel->archive.update();
+    return hr;
+}
+
+HRESULT SevenzipEncoderChannel::Open(const wchar_t *filename) {
+    return S_OK;
+}
+
+HRESULT SevenzipEncoderChannel::Read(void* data, UInt32 size, UInt32 &processed) {
+    // NOTE: called by the encoder threads, returns no data at the end
+    processed = 0;
+    bridge.Lock();
+    while (bufferStart == bufferEnd && !closing)
+        bridge.Wait();
+    size_t offset = (size_t)(bufferStart % bufferSize);
+    size_t count = (size_t)(bufferEnd - bufferStart);
+    if (count > size)
+        count = size;
+    if (count > bufferSize - offset)
+        count = bufferSize - offset;
+    memcpy(data, buffer + offset, count);
+    bufferStart += count;
+    processed = (UInt32)count;
+    bridge.Notify();
+    bridge.Unlock();
+    return S_OK;
+}
+
+HRESULT SevenzipEncoderChannel::Seek(Int64 offset, UInt32 origin, UInt64 &position) {
+    if (origin != SEEK_CUR || offset != 0)
+        return E_NOTIMPL;
+    bridge.Lock();
+    position = (UInt64)bufferStart;
+    bridge.Unlock();
+    return S_OK;
+}
+
+void SevenzipEncoderChannel::Close() {
+}
+
+sevenzip::Istream *SevenzipEncoderChannel::Clone() const {
+    return NULL;
+}
+
+bool SevenzipEncoderChannel::IsDir(const wchar_t *pathname) {
+    return false;
+}
+
+UInt64 SevenzipEncoderChannel::GetSize(const wchar_t *pathname) {
+    // NOTE: the size is not known in advance, all ones stand for unknown
+    return (UInt64)(Int64)-1;
+}
+
+UInt32 SevenzipEncoderChannel::GetMode(const wchar_t *pathname) {
+    return 0644;
+}
+
+UInt32 SevenzipEncoderChannel::GetAttr(const wchar_t *pathname) {
+    return 0;
+}
+
+UInt32 SevenzipEncoderChannel::GetTime(const wchar_t *pathname) {
+    return time;
+}
+
+int SevenzipEncoderChannel::ChannelClose(ClientData instanceData, Tcl_Interp *interp, int flags) {
+    SevenzipEncoderChannel *channel = (SevenzipEncoderChannel *)instanceData;
+    SevenzipBridge &bridge = channel->bridge;
+    if (flags & (TCL_CLOSE_READ | TCL_CLOSE_WRITE))
+        return EINVAL;
+    if (!channel->started)
+        return 0;
+    // NOTE: the end of data lets the encoder finish the archive, its output
+    // NOTE: is written to the parent before that is closed
+    bridge.Lock();
+    channel->closing = true;
+    bridge.Notify();
+    bridge.Unlock();
+    HRESULT hr = bridge.Join();
+    DEBUGLOG(channel << " SevenzipEncoderChannel::ChannelClose result " << hr);
+    delete channel;
+    return hr == S_OK ? 0 : EIO;
+}
+
+int SevenzipEncoderChannel::ChannelInput(ClientData instanceData, char *buf, int toRead, int *errorCodePtr) {
+    *errorCodePtr = EINVAL;
+    return -1;
+}
+
+int SevenzipEncoderChannel::ChannelOutput(ClientData instanceData, const char *buf, int toWrite, int *errorCodePtr) {
+    SevenzipEncoderChannel *channel = (SevenzipEncoderChannel *)instanceData;
+    SevenzipBridge &bridge = channel->bridge;
+    size_t size = channel->bufferSize;
+    int written = 0;
+    bridge.Lock();
+    while (written < toWrite) {
+        // NOTE: wait for room, the output of the encoder is written meanwhile
+        bool full = channel->bufferEnd - channel->bufferStart == (Tcl_WideInt)size;
+        while (full && bridge.IsRunning()) {
+            if (!bridge.Serve()) {
+                if (channel->nonblocking)
+                    break;
+                bridge.Wait();
+            }
+            full = channel->bufferEnd - channel->bufferStart == (Tcl_WideInt)size;
+        }
+        if (!bridge.IsRunning() || full)
+            break;
+        size_t offset = (size_t)(channel->bufferEnd % size);
+        size_t count = (size_t)(toWrite - written);
+        if (count > size - (size_t)(channel->bufferEnd - channel->bufferStart))
+            count = size - (size_t)(channel->bufferEnd - channel->bufferStart);
+        if (count > size - offset)
+            count = size - offset;
+        memcpy(channel->buffer + offset, buf + written, count);
+        channel->bufferEnd += count;
+        written += (int)count;
+        bridge.Notify();
+    }
+    // NOTE: pass on the output that is ready without waiting for more
+    while (bridge.Serve())
+        ;
+    bool running = bridge.IsRunning();
+    bridge.Unlock();
+
+    if (written < toWrite && running) {
+        // NOTE: non-blocking and the ring is full, the rest is written later
+        if (written > 0)
+            return written;
+        *errorCodePtr = EAGAIN;
+        return -1;
+    }
+    if (written < toWrite) {
+        // NOTE: the encoder is done before the end of data, it failed
+        *errorCodePtr = EIO;
+        return -1;
+    }
+    return written;
+}
+
+void SevenzipEncoderChannel::ChannelWatch(ClientData instanceData, int mask) {
+    SevenzipEncoderChannel *channel = (SevenzipEncoderChannel *)instanceData;
+    // NOTE: the transform is writable whenever its parent is
+    Tcl_DriverWatchProc *watchProc = Tcl_ChannelWatchProc(Tcl_GetChannelType(channel->parent));
+    watchProc(Tcl_GetChannelInstanceData(channel->parent), mask);
+}
+
+int SevenzipEncoderChannel::ChannelGetHandle(ClientData instanceData, int direction, ClientData *handlePtr) {
+    SevenzipEncoderChannel *channel = (SevenzipEncoderChannel *)instanceData;
+    return Tcl_GetChannelHandle(channel->parent, direction, handlePtr);
+}
+
+int SevenzipEncoderChannel::ChannelBlockMode(ClientData instanceData, int mode) {
+    SevenzipEncoderChannel *channel = (SevenzipEncoderChannel *)instanceData;
+    channel->nonblocking = (mode == TCL_MODE_NONBLOCKING);
+    return 0;
+}
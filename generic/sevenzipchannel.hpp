@@ -0,0 +1,222 @@
+#ifndef SEVENZIPCHANNEL_H
+#define SEVENZIPCHANNEL_H
+
+#include "sevenzipstream.hpp"
+
+// Read-only channel over the bytes of a Tcl_Obj, used when an item can not
+// be decoded on demand. The range channel reads an item that is stored
+// without compression straight from the archive stream, which it owns.
+
+Tcl_Channel SevenzipMemoryChannel_Create(Tcl_Obj *data);
+Tcl_Channel SevenzipRangeChannel_Create(sevenzip::Istream *stream, UInt64 offset, UInt64 length);
+
+// SevenzipItemChannel is a read-only channel that decodes an archive item on
+// demand. Extraction runs in a worker thread and writes into a bounded ring
+// buffer, the thread of the channel serves the stream calls of the worker
+// while it waits for data. The last windowSize bytes of decoded data are
+// kept, seeks within them are free, seeks back before them decode the item
+// again from the start. With a parent channel the item channel is stacked
+// on it as a decompressing transform.
+
+class SevenzipItemChannel: public sevenzip::Ostream {
+
+public:
+
+    SevenzipItemChannel(Tcl_Interp *interp, size_t bufferSize = 1024 * 1024,
+            size_t windowSize = 4 * 1024 * 1024);
+    virtual ~SevenzipItemChannel();
+
+    HRESULT Start(sevenzip::Lib &lib, sevenzip::Istream *stream, const wchar_t *filename,
+            const wchar_t *openPassword, int formatIndex, const wchar_t *password, int index,
+            Tcl_WideInt size, Tcl_Channel &channel, Tcl_Channel parent = NULL);
+
+    virtual HRESULT Open(const wchar_t *filename) override;
+    virtual HRESULT Write(const void *data, UInt32 size, UInt32 &processedSize) override;
+    virtual HRESULT Seek(Int64 offset, UInt32 seekOrigin, UInt64 &newPosition) override;
+    virtual void Close() override;
+
+    virtual HRESULT Mkdir(const wchar_t* pathname) override;
+    virtual HRESULT SetMode(const wchar_t* pathname, UInt32 mode) override;
+    virtual HRESULT SetAttr(const wchar_t* pathname, UInt32 attr) override;
+    virtual HRESULT SetTime(const wchar_t* pathname, UInt32 time) override;
+
+private:
+
+    Tcl_Interp *tclInterp;
+    Tcl_Channel tclChannel;
+
+    SevenzipBridge bridge;
+    SevenzipBridgeInStream *input;
+    sevenzip::Iarchive archive;
+    wchar_t *password;
+    int index;
+    Tcl_WideInt size;
+
+    // NOTE: ring of decoded data, stream offset o is at buffer[o % capacity]
+    char *buffer;
+    size_t bufferSize;
+    size_t windowSize;
+    size_t capacity;
+    Tcl_WideInt bufferStart;
+    Tcl_WideInt bufferEnd;
+    Tcl_WideInt position;
+    bool closing;
+    bool nonblocking;
+
+    Tcl_TimerToken timer;
+    int watchMask;
+    bool started;
+
+    HRESULT Begin(sevenzip::Lib &lib, const wchar_t *filename, const wchar_t *openPassword,
+            int formatIndex, const wchar_t *password, int index, Tcl_WideInt size);
+    void Stop();
+    HRESULT Restart();
+    int WaitData(int *errorCodePtr);
+
+    static HRESULT ExtractProc(void *clientData);
+
+    static int ChannelClose(ClientData instanceData, Tcl_Interp *interp, int flags);
+    static int ChannelInput(ClientData instanceData, char *buf, int toRead, int *errorCodePtr);
+    static int ChannelOutput(ClientData instanceData, const char *buf, int toWrite, int *errorCodePtr);
+    static Tcl_WideInt ChannelWideSeek(ClientData instanceData, Tcl_WideInt offset, int mode, int *errorCodePtr);
+#if TCL_MAJOR_VERSION < 9
+    static int ChannelSeek(ClientData instanceData, long offset, int mode, int *errorCodePtr);
+#endif
+    static void ChannelWatch(ClientData instanceData, int mask);
+    static void ChannelTimer(ClientData instanceData);
+    static int ChannelGetHandle(ClientData instanceData, int direction, ClientData *handlePtr);
+    static int ChannelBlockMode(ClientData instanceData, int mode);
+    static const Tcl_ChannelType channelType;
+};
+
+// SevenzipStackedInStream reads the compressed data of a decompressing
+// transform from the channel below it. Seekable channels are read through
+// their driver at the position the transform was pushed at, data read from
+// other channels is kept so that the decoder can seek back in it.
+
+class SevenzipStackedInStream: public sevenzip::Istream {
+
+public:
+
+    SevenzipStackedInStream(Tcl_Channel parent);
+    virtual ~SevenzipStackedInStream();
+
+    virtual HRESULT Open(const wchar_t *filename) override;
+    virtual HRESULT Read(void* data, UInt32 size, UInt32 &processed) override;
+    virtual HRESULT Seek(Int64 offset, UInt32 origin, UInt64 &position) override;
+    virtual void Close() override;
+
+    virtual sevenzip::Istream* Clone() const override;
+
+    virtual bool IsDir(const wchar_t *pathname) override;
+    virtual UInt64 GetSize(const wchar_t *pathname) override;
+    virtual UInt32 GetMode(const wchar_t *pathname) override;
+    virtual UInt32 GetAttr(const wchar_t *pathname) override;
+    virtual UInt32 GetTime(const wchar_t *pathname) override;
+
+private:
+
+    Tcl_Channel parent;
+    Tcl_WideInt base;
+    UInt64 position;
+    bool seekable;
+    bool moved;
+
+    // NOTE: data read so far from channels that can not seek
+    char *spool;
+    size_t spoolSize;
+    size_t spoolCapacity;
+    bool spoolDone;
+
+    bool fillSpool(UInt64 end);
+};
+
+// SevenzipStackedOutStream writes the output of a compressing transform to
+// the channel below it. Only formats written front to back can be used.
+
+class SevenzipStackedOutStream: public sevenzip::Ostream {
+
+public:
+
+    SevenzipStackedOutStream(Tcl_Channel parent): parent(parent), position(0) {};
+    virtual ~SevenzipStackedOutStream() {};
+
+    virtual HRESULT Open(const wchar_t *filename) override;
+    virtual HRESULT Write(const void *data, UInt32 size, UInt32 &processedSize) override;
+    virtual HRESULT Seek(Int64 offset, UInt32 seekOrigin, UInt64 &newPosition) override;
+    virtual void Close() override;
+
+    virtual HRESULT Mkdir(const wchar_t* pathname) override;
+    virtual HRESULT SetMode(const wchar_t* pathname, UInt32 mode) override;
+    virtual HRESULT SetAttr(const wchar_t* pathname, UInt32 attr) override;
+    virtual HRESULT SetTime(const wchar_t* pathname, UInt32 time) override;
+
+private:
+
+    Tcl_Channel parent;
+    UInt64 position;
+};
+
+// SevenzipEncoderChannel is a write-only transform stacked on a channel. The
+// data written to it is the single item of an archive that is encoded in a
+// worker thread, the encoder reads it from a bounded ring buffer and its
+// output is written to the parent channel by the thread of the channel. The
+// archive is finished when the transform is closed or popped.
+
+class SevenzipEncoderChannel: public sevenzip::Istream {
+
+public:
+
+    SevenzipEncoderChannel(Tcl_Interp *interp, Tcl_Channel parent, size_t bufferSize = 1024 * 1024);
+    virtual ~SevenzipEncoderChannel();
+
+    HRESULT Create(sevenzip::Lib &lib, int formatIndex);
+    sevenzip::Oarchive &GetArchive() {return archive;};
+    HRESULT Start(Tcl_Channel &channel);
+
+    virtual HRESULT Open(const wchar_t *filename) override;
+    virtual HRESULT Read(void* data, UInt32 size, UInt32 &processed) override;
+    virtual HRESULT Seek(Int64 offset, UInt32 origin, UInt64 &position) override;
+    virtual void Close() override;
+
+    virtual sevenzip::Istream* Clone() const override;
+
+    virtual bool IsDir(const wchar_t *pathname) override;
+    virtual UInt64 GetSize(const wchar_t *pathname) override;
+    virtual UInt32 GetMode(const wchar_t *pathname) override;
+    virtual UInt32 GetAttr(const wchar_t *pathname) override;
+    virtual UInt32 GetTime(const wchar_t *pathname) override;
+
+private:
+
+    Tcl_Interp *tclInterp;
+    Tcl_Channel tclChannel;
+    Tcl_Channel parent;
+
+    SevenzipBridge bridge;
+    SevenzipStackedOutStream output;
+    SevenzipBridgeOutStream bridgeOutput;
+    sevenzip::Oarchive archive;
+    UInt32 time;
+
+    // NOTE: ring of data not yet read by the encoder
+    char *buffer;
+    size_t bufferSize;
+    Tcl_WideInt bufferStart;
+    Tcl_WideInt bufferEnd;
+    bool closing;
+    bool nonblocking;
+    bool started;
+
+    static HRESULT EncodeProc(void *clientData);
+
+    static int ChannelClose(ClientData instanceData, Tcl_Interp *interp, int flags);
+    static int ChannelInput(ClientData instanceData, char *buf, int toRead, int *errorCodePtr);
+    static int ChannelOutput(ClientData instanceData, const char *buf, int toWrite, int *errorCodePtr);
+    static void ChannelWatch(ClientData instanceData, int mask);
+    static int ChannelGetHandle(ClientData instanceData, int direction, ClientData *handlePtr);
+    static int ChannelBlockMode(ClientData instanceData, int mode);
+    static const Tcl_ChannelType channelType;
+};
+
+#endif
@@ -1,6 +1,8 @@
 #include "sevenzipcmd.hpp"
 #include "sevenziparchivecmd.hpp"
+#include "sevenzipchannel.hpp"
 
+#include <string.h>
 #include <wchar.h>
 
 #if defined(SEVENZIPCMD_DEBUG)
@@ -12,10 +14,12 @@
 
 int SevenzipCmd::Command (int objc, Tcl_Obj *const objv[]) {
     static const char *const commands[] = {
-        "initialize", "isinitialized", "format", "formats", "extensions", "updatable", "open", "create", 0L
+        "initialize", "isinitialized", "format", "formats", "extensions", "updatable", "open", "create",
+        "mount", "unmount", "push", 0L
     };
     enum commands {
-        cmInitialize, cmIsInitialized, cmFormat, cmFormats, cmExtensions, cmUpdatable, cmOpen, cmCreate
+        cmInitialize, cmIsInitialized, cmFormat, cmFormats, cmExtensions, cmUpdatable, cmOpen, cmCreate,
+        cmMount, cmUnmount, cmPush
     };
     int index;
 
@@ -113,18 +117,31 @@ int SevenzipCmd::Command (int objc, Tcl_Obj *const objv[]) {
         break;
 
     case cmOpen:
+    case cmMount:
 
-        // open ?-detecttype|-forcetype? ?-password password? -channel -- chan | filename
-        if (objc > 2) {
+        // open ?-detecttype|-forcetype? ?-password password? ?-mmap? ?-buffersize size? ?-readahead? ?-channel|-data? chan | data | filename
+        // mount ?-detecttype|-forcetype? ?-password password? ?-mmap? ?-buffersize size? ?-readahead? ?-data? data | filename mountpoint
+        if (objc > ((enum commands)(index) == cmMount ? 3 : 2)) {
             static const char *const options[] = {
-                "-detecttype", "-forcetype", "-password", "-channel", 0L
+                "-detecttype", "-forcetype", "-password", "-channel", "-data", "-mmap",
+                "-buffersize", "-readahead", 0L
             };
             enum options {
-                opDetecttype, opForcetype, opPassword, opChannel
+                opDetecttype, opForcetype, opPassword, opChannel, opData, opMmap,
+                opBuffersize, opReadahead
             };
+            // NOTE: mount has the mount point after the archive
+            Tcl_Obj *mountpoint = NULL;
+            if ((enum commands)(index) == cmMount) {
+                mountpoint = objv[--objc];
+            }
             int index;
             bool detecttype = false;
             bool usechannel = false;
+            bool usedata = false;
+            bool usemmap = false;
+            bool readahead = false;
+            Tcl_WideInt buffersize = 0;
             Tcl_Obj *password = NULL;
             Tcl_Obj *forcetype = NULL;
             for (int i = 2; i < objc - 1; i++) {
@@ -154,8 +171,31 @@ int SevenzipCmd::Command (int objc, Tcl_Obj *const objv[]) {
                     }
                     break;
                 case opChannel:
+                    if (mountpoint) {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "bad option \"-channel\": archive channels can not be mounted", -1));
+                        return TCL_ERROR;
+                    }
                     usechannel = true;
                     break;
+                case opData:
+                    usedata = true;
+                    break;
+                case opMmap:
+                    usemmap = true;
+                    break;
+                case opBuffersize:
+                    if (i < objc - 2 && Tcl_GetWideIntFromObj(NULL, objv[i+1], &buffersize) == TCL_OK && buffersize > 0) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-buffersize\" option must be followed by buffer size", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opReadahead:
+                    readahead = true;
+                    break;
                 }
             }
             if (detecttype && forcetype != NULL) {
@@ -163,20 +203,45 @@ int SevenzipCmd::Command (int objc, Tcl_Obj *const objv[]) {
                     "only one of options \"-detecttype\" or \"-forcetype\" must be specified", -1));
                 return TCL_ERROR;
             }
+            if (usechannel && usedata) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                    "only one of options \"-channel\" or \"-data\" must be specified", -1));
+                return TCL_ERROR;
+            }
 
             if (!lib.isLoaded() && (Initialize(NULL) != TCL_OK))
                 return TCL_ERROR;
 
-            int type = (usechannel || detecttype) ? -2 : -1;
+            int type = (usechannel || usedata || detecttype) ? -2 : -1;
             if (forcetype)
                 if (GetFormat(forcetype, type) != TCL_OK)
                     return TCL_ERROR;
 
             static unsigned long archiveCounter = 0;
             auto command = Tcl_ObjPrintf("sevenzip%lu", archiveCounter++);
-            return OpenArchive(command, objv[objc-1], password, type, usechannel);
+            return OpenArchive(command, objv[objc-1], password, type, usechannel, usedata, usemmap,
+                    (size_t)buffersize, readahead, mountpoint);
         } else {
-            Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? path");
+            Tcl_WrongNumArgs(tclInterp, 2, objv, (enum commands)(index) == cmMount
+                    ? "?options? path mountpoint" : "?options? path");
+            return TCL_ERROR;
+        }
+
+        break;
+
+    case cmUnmount:
+
+        if (objc == 3) {
+            auto archive = SevenzipMount::Find(objv[2]);
+            if (!archive) {
+                Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                    "\"%s\" is not mounted", Tcl_GetString(objv[2])));
+                return TCL_ERROR;
+            }
+            // NOTE: the archive handle is closed with the mount
+            delete archive;
+        } else {
+            Tcl_WrongNumArgs(tclInterp, 2, objv, "mountpoint");
             return TCL_ERROR;
         }
 
@@ -184,27 +249,47 @@ int SevenzipCmd::Command (int objc, Tcl_Obj *const objv[]) {
 
     case cmCreate:
 
-        // create ?-properties proplist? ?-forcetype type? ?-password password? ?-inputchannel channel? ?-channel? channel | filename files
+        // create ?-properties proplist? ?-forcetype type? ?-password password? ?-inputchannel channel? ?-threads count? ?-buffersize size? ?-readahead? ?-data list? ?-mtime time? ?-mode mode? ?-channel? ?--? channel | filename | -result ?--? files
         if (objc > 3) {
             static const char *const options[] = {
-                "-properties", "-forcetype", "-password", "-inputchannel", "-channel", 0L
+                "-properties", "-forcetype", "-password", "-inputchannel", "-threads", "-channel",
+                "-buffersize", "-readahead", "-data", "-mtime", "-mode", "-result", "--", 0L
             };
             enum options {
-                opProperties, opForcetype, opPassword, opInputChannel, opChannel
+                opProperties, opForcetype, opPassword, opInputChannel, opThreads, opChannel,
+                opBuffersize, opReadahead, opData, opMtime, opMode, opResult, opEnd
             };
             int index;
+            int threads = -1;
             bool usechannel = false;
+            bool readahead = false;
+            Tcl_WideInt buffersize = 0;
             Tcl_Obj *inputchannel = NULL;
             Tcl_Obj *properties = NULL;
             Tcl_Obj *password = NULL;
             Tcl_Obj *forcetype = NULL;
-            for (int i = 2; i < objc - 2; i++) {
+            Tcl_Obj *data = NULL;
+            Tcl_WideInt mtime = -1;
+            int mode = 0644;
+            bool useresult = false;
+            // NOTE: with -result there is no archive path, only the files list follows the options
+            int last = objc - 2;
+            int i;
+            for (i = 2; i < objc - 1; i++) {
+                // NOTE: in the slot of the archive path only -result and -- are options
+                if (i >= last && !useresult && strcmp(Tcl_GetString(objv[i]), "-result") != 0
+                        && strcmp(Tcl_GetString(objv[i]), "--") != 0)
+                    break;
                 if (Tcl_GetIndexFromObj(tclInterp, objv[i], options, "option", 0, &index) != TCL_OK) {
                     return TCL_ERROR;
                 }
+                if ((enum options)(index) == opEnd) {
+                    i++;
+                    break;
+                }
                 switch ((enum options)(index)) {
                 case opProperties:
-                    if (i < objc - 3) {
+                    if (i < last - 1) {
                         properties = objv[++i];
                         Tcl_Size length;
                         if (Tcl_ListObjLength(tclInterp, properties, &length) != TCL_OK)
@@ -221,7 +306,7 @@ int SevenzipCmd::Command (int objc, Tcl_Obj *const objv[]) {
                     }
                     break;
                 case opForcetype:
-                    if (i < objc - 3) {
+                    if (i < last - 1) {
                         forcetype = objv[++i];
                     } else {
                         Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
@@ -230,7 +315,7 @@ int SevenzipCmd::Command (int objc, Tcl_Obj *const objv[]) {
                     }
                     break;
                 case opPassword:
-                    if (i < objc - 3) {
+                    if (i < last - 1) {
                         password = objv[++i];
                     } else {
                         Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
@@ -239,7 +324,7 @@ int SevenzipCmd::Command (int objc, Tcl_Obj *const objv[]) {
                     }
                     break;
                 case opInputChannel:
-                    if (i < objc - 3) {
+                    if (i < last - 1) {
                         inputchannel = objv[++i];
                     } else {
                         Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
@@ -247,11 +332,92 @@ int SevenzipCmd::Command (int objc, Tcl_Obj *const objv[]) {
                         return TCL_ERROR;
                     }
                     break;                   
+                case opThreads:
+                    if (i < last - 1 && Tcl_GetIntFromObj(NULL, objv[i+1], &threads) == TCL_OK && threads >= 0) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-threads\" option must be followed by number of threads", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
                 case opChannel:
                     usechannel = true;
                     break;
+                case opResult:
+                    useresult = true;
+                    last = objc - 1;
+                    break;
+                case opBuffersize:
+                    if (i < last - 1 && Tcl_GetWideIntFromObj(NULL, objv[i+1], &buffersize) == TCL_OK && buffersize > 0) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-buffersize\" option must be followed by buffer size", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opReadahead:
+                    readahead = true;
+                    break;
+                case opData:
+                    if (i < last - 1) {
+                        data = objv[++i];
+                        Tcl_Size length;
+                        if (Tcl_ListObjLength(tclInterp, data, &length) != TCL_OK)
+                            return TCL_ERROR;
+                        if (length % 2 != 0) {
+                            Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                                "\"-data\" option must be followed by an even-length list", -1));
+                            return TCL_ERROR;
+                        }
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-data\" option must be followed by list of names and data", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opMtime:
+                    if (i < last - 1 && Tcl_GetWideIntFromObj(NULL, objv[i+1], &mtime) == TCL_OK && mtime >= 0) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-mtime\" option must be followed by time in seconds", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opMode:
+                    if (i < last - 1 && Tcl_GetIntFromObj(NULL, objv[i+1], &mode) == TCL_OK && mode >= 0) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-mode\" option must be followed by permissions", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opEnd:
+                    break;
                 }
             }
+            if (objc - i != (useresult ? 1 : 2)) {
+                Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? path list");
+                return TCL_ERROR;
+            }
+            if (useresult && usechannel) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                    "\"-result\" and \"-channel\" options can not be used together", -1));
+                return TCL_ERROR;
+            }
+            if (useresult && !forcetype) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                    "\"-result\" option requires \"-forcetype\" option", -1));
+                return TCL_ERROR;
+            }
+            if (data && inputchannel) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                    "\"-data\" and \"-inputchannel\" options can not be used together", -1));
+                return TCL_ERROR;
+            }
 
             if (!lib.isLoaded() && (Initialize(NULL) != TCL_OK))
                 return TCL_ERROR;
@@ -261,13 +427,122 @@ int SevenzipCmd::Command (int objc, Tcl_Obj *const objv[]) {
                 if (GetFormat(forcetype, type) != TCL_OK)
                     return TCL_ERROR;
 
-            return CreateArchive(objv[objc-1], objv[objc-2],
-                    inputchannel, password, type, usechannel, properties);
+            return CreateArchive(objv[objc-1], useresult ? NULL : objv[objc-2],
+                    inputchannel, password, type, usechannel, properties, threads,
+                    (size_t)buffersize, readahead, data, mtime, mode);
         } else {
             Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? path list");
             return TCL_ERROR;
         }
 
+        break;
+
+    case cmPush:
+
+        // push ?-format type? ?-properties proplist? ?-compress|-decompress? channel
+        if (objc > 2) {
+            static const char *const options[] = {
+                "-format", "-properties", "-compress", "-decompress", 0L
+            };
+            enum options {
+                opFormat, opProperties, opCompress, opDecompress
+            };
+            int index;
+            Tcl_Obj *format = NULL;
+            Tcl_Obj *properties = NULL;
+            bool compress = false;
+            bool decompress = false;
+            for (int i = 2; i < objc - 1; i++) {
+                if (Tcl_GetIndexFromObj(tclInterp, objv[i], options, "option", 0, &index) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                switch ((enum options)(index)) {
+                case opFormat:
+                    if (i < objc - 2) {
+                        format = objv[++i];
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-format\" option must be followed by type", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opProperties:
+                    if (i < objc - 2) {
+                        properties = objv[++i];
+                        Tcl_Size length;
+                        if (Tcl_ListObjLength(tclInterp, properties, &length) != TCL_OK)
+                            return TCL_ERROR;
+                        if (length % 2 != 0) {
+                            Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                                "\"-properties\" option must be followed by an even-length list", -1));
+                            return TCL_ERROR;
+                        }
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-properties\" option must be followed by property dictionary", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opCompress:
+                    compress = true;
+                    break;
+                case opDecompress:
+                    decompress = true;
+                    break;
+                }
+            }
+            if (compress && decompress) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                    "only one of options \"-compress\" or \"-decompress\" must be specified", -1));
+                return TCL_ERROR;
+            }
+            int mode;
+            Tcl_Channel parent = Tcl_GetChannel(tclInterp, Tcl_GetString(objv[objc-1]), &mode);
+            if (!parent)
+                return TCL_ERROR;
+            // NOTE: without an option the direction follows the channel
+            if (!compress && !decompress) {
+                if (mode == TCL_WRITABLE)
+                    compress = true;
+                else if (mode == TCL_READABLE)
+                    decompress = true;
+                else {
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                        "channels open for reading and writing need \"-compress\" or \"-decompress\" option", -1));
+                    return TCL_ERROR;
+                }
+            }
+            if (!(mode & (compress ? TCL_WRITABLE : TCL_READABLE))) {
+                Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("channel \"%s\" wasn't opened for %s",
+                        Tcl_GetString(objv[objc-1]), compress ? "writing" : "reading"));
+                return TCL_ERROR;
+            }
+            if (compress && !format) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                    "\"-compress\" option requires \"-format\" option", -1));
+                return TCL_ERROR;
+            }
+            if (decompress && properties) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                    "\"-properties\" and \"-decompress\" options can not be used together", -1));
+                return TCL_ERROR;
+            }
+
+            if (!lib.isLoaded() && (Initialize(NULL) != TCL_OK))
+                return TCL_ERROR;
+
+            // NOTE: without format the data is decoded as detected by signature
+            int type = -2;
+            if (format)
+                if (GetFormat(format, type) != TCL_OK)
+                    return TCL_ERROR;
+
+            return PushTransform(parent, type, compress, properties);
+        } else {
+            Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? channel");
+            return TCL_ERROR;
+        }
+
         break;
     }
 
@@ -333,71 +608,94 @@ int SevenzipCmd::SupportedFormats (Tcl_Obj *formats) {
 }
 
 int SevenzipCmd::OpenArchive(Tcl_Obj *command, Tcl_Obj *source,
-        Tcl_Obj *password, int type, bool usechannel) {
+        Tcl_Obj *password, int type, bool usechannel, bool usedata, bool usemmap,
+        size_t buffersize, bool readahead, Tcl_Obj *mountpoint) {
     // TODO: stream should be owned by archive cmd, create it there?
     auto archive = new SevenzipArchiveCmd(tclInterp, Tcl_GetString(command), this);
     auto stream = new SevenzipInStream(tclInterp);
+    stream->SetMmap(usemmap);
+    stream->SetBufferSize(buffersize);
+    stream->SetReadahead(readahead);
     HRESULT hr = S_OK;
     if (usechannel)
         hr = stream->AttachOpenChannel(source);
+    else if (usedata)
+        hr = stream->AttachObj(source);
     if (hr != S_OK)
         delete stream;
     if (hr == S_OK)
-        hr = archive->Open(lib, stream, usechannel ? NULL : source, password, type);
+        hr = archive->Open(lib, stream, (usechannel || usedata) ? NULL : source, password, type);
     if (hr != S_OK) {
         delete archive; 
         Tcl_DecrRefCount(command);
         return lastError(tclInterp, hr);
     }
+    if (mountpoint && archive->Mount(mountpoint, password) != TCL_OK) {
+        delete archive; 
+        Tcl_DecrRefCount(command);
+        return TCL_ERROR;
+    }
     Tcl_SetObjResult(tclInterp, command);
     return TCL_OK;
 }
 
+// NOTE: the update job run by the bridge worker thread
+struct SevenzipUpdateJob {
+    sevenzip::Oarchive *archive;
+    int threads;
+};
+
+static HRESULT SevenzipUpdateProc(void *clientData) {
+    SevenzipUpdateJob *job = (SevenzipUpdateJob *)clientData;
+    if (job->threads > 0)
+        job->archive->addIntOption(L"mt", job->threads);
+    else
+        // NOTE: zero threads lets the codec decide, negative means single thread
+        job->archive->addBoolOption(L"mt", job->threads == 0);
+    HRESULT hr = job->archive->update();
+    if (hr == E_NOINTERFACE) // looks like options are not supported, skip error
+        hr = job->archive->update();
+    return hr;
+}
+
 int SevenzipCmd::CreateArchive(Tcl_Obj *pathnames, Tcl_Obj *destination, Tcl_Obj *source,
-        Tcl_Obj *password, int type, bool usechannel, Tcl_Obj *properties) {
+        Tcl_Obj *password, int type, bool usechannel, Tcl_Obj *properties, int threads,
+        size_t buffersize, bool readahead, Tcl_Obj *data, Tcl_WideInt mtime, int mode) {
+    // NOTE: without destination the archive is written into a byte array
+    // NOTE: that becomes the result of the command
+    DEBUGLOG(this << " SevenzipCmd::CreateArchive threads " << threads << " buffersize " << buffersize);
     sevenzip::Oarchive archive;
     SevenzipInStream istream(tclInterp);
     SevenzipOutStream ostream(tclInterp);
+    // NOTE: the archive works through the bridge, so codec threads never touch Tcl
+    SevenzipBridge bridge;
+    SevenzipBridgeInStream bridgeIstream(&bridge, &istream, false);
+    SevenzipBridgeOutStream bridgeOstream(&bridge, &ostream);
+    SevenzipPrefetcher prefetcher;
+    SevenzipMetadata metadata;
     wchar_t buffer[1024];
     HRESULT hr = S_OK;
+    // NOTE: read-ahead applies to the input files, the archive is written behind
+    istream.SetBufferSize(buffersize);
+    istream.SetReadahead(readahead);
+    ostream.SetBufferSize(buffersize);
     if (source)
         if (istream.AttachOpenChannel(source) != S_OK)
             return lastError(tclInterp, E_FAIL);
     if (usechannel)
         if (ostream.AttachOpenChannel(destination) != S_OK)
             return lastError(tclInterp, E_FAIL);
+    if (!destination)
+        if (ostream.AttachObj(Tcl_NewByteArrayObj(NULL, 0)) != S_OK)
+            return lastError(tclInterp, E_FAIL);
     if (hr == S_OK)
-        hr = archive.open(lib, istream, ostream,
-                usechannel ? NULL : sevenzip::fromBytes(Tcl_GetString(destination)),
+        hr = archive.open(lib, bridgeIstream, bridgeOstream,
+                (usechannel || !destination) ? NULL : sevenzip::fromBytes(Tcl_GetString(destination)),
                 password ? sevenzip::fromBytes(buffer, sizeof(buffer)/sizeof(wchar_t), Tcl_GetString(password)) : NULL,
                 type);
-    if (hr == S_OK && properties) {
-        Tcl_Size length;
-        if (Tcl_ListObjLength(tclInterp, properties, &length) != TCL_OK)
+    if (hr == S_OK && properties)
+        if (AddProperties(archive, properties) != TCL_OK)
             return TCL_ERROR;
-        for (int i = 0; i < length; i += 2) {
-            Tcl_Obj *key;
-            Tcl_Obj *value;
-            if (Tcl_ListObjIndex(tclInterp, properties, i, &key) != TCL_OK)
-                return TCL_ERROR;
-            if (Tcl_ListObjIndex(tclInterp, properties, i + 1, &value) != TCL_OK)
-                return TCL_ERROR;
-            int intValue;
-            if (Tcl_GetIntFromObj(tclInterp, value, &intValue) == TCL_OK)
-                archive.addIntOption(
-                        sevenzip::fromBytes(Tcl_GetString(key)), intValue);
-            else if (Tcl_GetBooleanFromObj(tclInterp, value, &intValue) == TCL_OK)
-                archive.addBoolOption(
-                        sevenzip::fromBytes(Tcl_GetString(key)), intValue);
-            else
-                archive.addStringOption(
-                        sevenzip::fromBytes(Tcl_GetString(key)),
-                        sevenzip::fromBytes(buffer, sizeof(buffer)/sizeof(wchar_t), Tcl_GetString(value)));
-            Tcl_ResetResult(tclInterp);
-        }
-    }
-    // NOTE: use single thread to avoid Tcl threading issues    
-    archive.addBoolOption(L"mt", false);
     if (hr == S_OK) {
         Tcl_Size length;
         if (Tcl_ListObjLength(tclInterp, pathnames, &length) != TCL_OK)
@@ -410,14 +708,118 @@ int SevenzipCmd::CreateArchive(Tcl_Obj *pathnames, Tcl_Obj *destination, Tcl_Obj
             if (Tcl_ListObjIndex(tclInterp, pathnames, i, &item) != TCL_OK)
                 return TCL_ERROR;
             archive.addItem(sevenzip::fromBytes(Tcl_GetString(item)));
+            if (!source)
+                metadata.Add(item);
+            if (threads >= 0 && !source)
+                prefetcher.Add(item);
+        }
+        if (data) {
+            // NOTE: data items are served from memory, they are never stat'ed or opened
+            Tcl_Size dataLength;
+            Tcl_Obj **dataItems;
+            if (Tcl_ListObjGetElements(tclInterp, data, &dataLength, &dataItems) != TCL_OK)
+                return TCL_ERROR;
+            if (mtime < 0) {
+                Tcl_Time now;
+                Tcl_GetTime(&now);
+                mtime = now.sec;
+            }
+            for (Tcl_Size i = 0; i + 1 < dataLength; i += 2) {
+#if TCL_MAJOR_VERSION >= 9
+                if (Tcl_GetBytesFromObj(tclInterp, dataItems[i+1], NULL) == NULL)
+                    return TCL_ERROR;
+#endif
+                archive.addItem(sevenzip::fromBytes(Tcl_GetString(dataItems[i])));
+                metadata.AddData(dataItems[i], dataItems[i+1], (UInt32)mtime, (UInt32)mode);
+            }
+        }
+        // NOTE: the encoder asks for the metadata of every item, collect it in one go
+        metadata.Scan();
+        istream.SetMetadata(&metadata);
+    }
+    if (hr == S_OK) {
+        SevenzipUpdateJob job = {&archive, threads};
+        if (threads >= 0 && bridge.Start(SevenzipUpdateProc, &job)) {
+            // NOTE: input files are read ahead while the stream calls
+            // NOTE: of the worker threads are served by this thread
+            if (prefetcher.Start())
+                istream.SetPrefetcher(&prefetcher);
+            hr = bridge.Join();
+            istream.SetPrefetcher(NULL);
+            prefetcher.Stop();
+        } else {
+            // NOTE: use single thread to avoid Tcl threading issues
+            job.threads = -1;
+            hr = SevenzipUpdateProc(&job);
         }
     }
-    if (hr == S_OK)
-        hr = archive.update();
-    if (hr == E_NOINTERFACE) // looks like options are not supported, skip error
-        hr = archive.update();
     if (hr != S_OK)
         return lastError(tclInterp, hr);
+    if (!destination) {
+        // NOTE: the reference of the stream is passed on with the value
+        Tcl_Obj *result = ostream.DetachObj();
+        Tcl_SetObjResult(tclInterp, result);
+        Tcl_DecrRefCount(result);
+    }
+    return TCL_OK;
+}
+
+int SevenzipCmd::AddProperties(sevenzip::Oarchive &archive, Tcl_Obj *properties) {
+    wchar_t buffer[1024];
+    Tcl_Size length;
+    if (Tcl_ListObjLength(tclInterp, properties, &length) != TCL_OK)
+        return TCL_ERROR;
+    for (int i = 0; i < length; i += 2) {
+        Tcl_Obj *key;
+        Tcl_Obj *value;
+        if (Tcl_ListObjIndex(tclInterp, properties, i, &key) != TCL_OK)
+            return TCL_ERROR;
+        if (Tcl_ListObjIndex(tclInterp, properties, i + 1, &value) != TCL_OK)
+            return TCL_ERROR;
+        int intValue;
+        if (Tcl_GetIntFromObj(tclInterp, value, &intValue) == TCL_OK)
+            archive.addIntOption(
+                    sevenzip::fromBytes(Tcl_GetString(key)), intValue);
+        else if (Tcl_GetBooleanFromObj(tclInterp, value, &intValue) == TCL_OK)
+            archive.addBoolOption(
+                    sevenzip::fromBytes(Tcl_GetString(key)), intValue);
+        else
+            archive.addStringOption(
+                    sevenzip::fromBytes(Tcl_GetString(key)),
+                    sevenzip::fromBytes(buffer, sizeof(buffer)/sizeof(wchar_t), Tcl_GetString(value)));
+        Tcl_ResetResult(tclInterp);
+    }
+    return TCL_OK;
+}
+
+int SevenzipCmd::PushTransform(Tcl_Channel parent, int type, bool compress, Tcl_Obj *properties) {
+    // NOTE: single-stream formats (xz, gzip, bzip2, ...) are used as archives
+    // NOTE: of one item, the transform passes the data of that item
+    DEBUGLOG(this << " SevenzipCmd::PushTransform type " << type << " compress " << compress);
+    Tcl_Channel channel = NULL;
+    if (compress) {
+        SevenzipEncoderChannel *encoder = new SevenzipEncoderChannel(tclInterp, parent);
+        HRESULT hr = encoder->Create(lib, type);
+        if (hr == S_OK && properties && AddProperties(encoder->GetArchive(), properties) != TCL_OK) {
+            delete encoder;
+            return TCL_ERROR;
+        }
+        if (hr == S_OK)
+            hr = encoder->Start(channel);
+        if (hr != S_OK) {
+            delete encoder;
+            return lastError(tclInterp, hr);
+        }
+    } else {
+        SevenzipItemChannel *decoder = new SevenzipItemChannel(tclInterp);
+        HRESULT hr = decoder->Start(lib, new SevenzipStackedInStream(parent), NULL, NULL, type, NULL, 0,
+                -1, channel, parent);
+        if (hr != S_OK) {
+            delete decoder;
+            return lastError(tclInterp, hr);
+        }
+    }
+    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(Tcl_GetChannelName(channel), -1));
     return TCL_OK;
 }
 
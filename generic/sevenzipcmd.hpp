@@ -21,9 +21,14 @@ private:
     int SupportedExts (Tcl_Obj *exts);
     int SupportedFormats (Tcl_Obj *formats);
     int OpenArchive(Tcl_Obj *command, Tcl_Obj *source,
-            Tcl_Obj *password, int type, bool usechannel);
+            Tcl_Obj *password, int type, bool usechannel, bool usedata, bool usemmap,
+            size_t buffersize = 0, bool readahead = false, Tcl_Obj *mountpoint = NULL);
     int CreateArchive(Tcl_Obj *pathnames, Tcl_Obj *destination, Tcl_Obj *source, 
-            Tcl_Obj *password, int type, bool usechannel, Tcl_Obj *properties);
+            Tcl_Obj *password, int type, bool usechannel, Tcl_Obj *properties, int threads = -1,
+            size_t buffersize = 0, bool readahead = false, Tcl_Obj *data = NULL, Tcl_WideInt mtime = -1,
+            int mode = 0644);
+    int AddProperties(sevenzip::Oarchive &archive, Tcl_Obj *properties);
+    int PushTransform(Tcl_Channel parent, int type, bool compress, Tcl_Obj *properties);
     int GetFormat(Tcl_Obj *index, int &type);
 
     virtual int Command (int objc, Tcl_Obj * const objv[]);
@@ -0,0 +1,470 @@
+#include "sevenzipfs.hpp"
+#include "sevenziparchivecmd.hpp"
+#include "sevenzipchannel.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <sys/utime.h>
+#else
+#include <utime.h>
+#endif
+
+#include <sys/stat.h>
+#ifndef S_IFDIR
+#define S_IFDIR _S_IFDIR
+#endif
+#ifndef S_IFREG
+#define S_IFREG _S_IFREG
+#endif
+#ifndef W_OK
+#define W_OK 2
+#endif
+
+#if defined(SEVENZIPFS_DEBUG)
+#   include <iostream>
+#   define DEBUGLOG(_x_) (std::cerr << "DEBUG: " << _x_ << "\n")
+#else
+#   define DEBUGLOG(_x_)
+#endif
+
+SevenzipMount *SevenzipMount::mounts = NULL;
+Tcl_Mutex SevenzipMount::mountsMutex = NULL;
+bool SevenzipMount::registered = false;
+
+const Tcl_Filesystem SevenzipMount::filesystem = {
+    "sevenzip",
+    sizeof(Tcl_Filesystem),
+    TCL_FILESYSTEM_VERSION_1,
+    FsPathInFilesystem,
+    NULL,                       // dupInternalRepProc
+    NULL,                       // freeInternalRepProc
+    NULL,                       // internalToNormalizedProc
+    NULL,                       // createInternalRepProc
+    NULL,                       // normalizePathProc
+    FsFilesystemPathType,
+    FsFilesystemSeparator,
+    FsStat,
+    FsAccess,
+    FsOpenFileChannel,
+    FsMatchInDirectory,
+    FsUtime,
+    NULL,                       // linkProc
+    NULL,                       // listVolumesProc
+    NULL,                       // fileAttrStringsProc
+    NULL,                       // fileAttrsGetProc
+    NULL,                       // fileAttrsSetProc
+    FsCreateDirectory,
+    FsRemoveDirectory,
+    FsDeleteFile,
+    NULL,                       // copyFileProc
+    NULL,                       // renameFileProc
+    NULL,                       // copyDirectoryProc
+    FsStat,                     // lstatProc
+    NULL,                       // loadFileProc, Tcl copies the file to load it
+    NULL,                       // getCwdProc
+    NULL                        // chdirProc, Tcl uses stat and access
+};
+
+SevenzipMount::SevenzipMount(SevenzipArchiveCmd *archive, Tcl_Obj *password):
+        archive(archive), password(password), owner(Tcl_GetCurrentThread()),
+        mountpoint(NULL), mountpointLength(0), next(NULL) {
+    DEBUGLOG(this << " SevenzipMount");
+    if (password)
+        Tcl_IncrRefCount(password);
+    Tcl_InitHashTable(&nodes, TCL_STRING_KEYS);
+    addNode("", true);
+}
+
+SevenzipMount::~SevenzipMount() {
+    DEBUGLOG(this << " ~SevenzipMount");
+    Unmount();
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(&nodes, &search); entry; entry = Tcl_NextHashEntry(&search))
+        ckfree((char *)Tcl_GetHashValue(entry));
+    Tcl_DeleteHashTable(&nodes);
+    if (password)
+        Tcl_DecrRefCount(password);
+}
+
+void SevenzipMount::AddItem(const char *path, int index, bool isdir, UInt64 size, UInt32 time, UInt32 mode) {
+    // NOTE: skip empty and "." components, items with ".." components are not shown
+    Tcl_DString normalized;
+    Tcl_DStringInit(&normalized);
+    for (const char *p = path; p && *p; ) {
+        const char *end = strchr(p, '/');
+        size_t length = end ? (size_t)(end - p) : strlen(p);
+        if (length == 2 && p[0] == '.' && p[1] == '.') {
+            DEBUGLOG(this << " SevenzipMount::AddItem skip " << path);
+            Tcl_DStringFree(&normalized);
+            return;
+        }
+        if (length > 0 && !(length == 1 && p[0] == '.')) {
+            if (Tcl_DStringLength(&normalized) > 0)
+                Tcl_DStringAppend(&normalized, "/", 1);
+            Tcl_DStringAppend(&normalized, p, (int)length);
+        }
+        p += length + (end ? 1 : 0);
+    }
+    if (Tcl_DStringLength(&normalized) == 0) {
+        if (isdir) {
+            Tcl_DStringFree(&normalized);
+            return;
+        }
+        // NOTE: single stream archives (gz, bz2, ...) have items without path
+        Tcl_DStringAppend(&normalized, "[Content]", -1);
+    }
+
+    Node *node = addNode(Tcl_DStringValue(&normalized), isdir);
+    Tcl_DStringFree(&normalized);
+    if (node->isdir != isdir)
+        return;
+    node->index = index;
+    node->size = isdir ? 0 : size;
+    node->time = time;
+    if (mode & 0xF000)
+        node->mode = mode;
+    else
+        node->mode = (isdir ? S_IFDIR : S_IFREG) | (mode ? mode : (isdir ? 0777 : 0555));
+}
+
+SevenzipMount::Node *SevenzipMount::addNode(const char *path, bool isdir) {
+    int isNew;
+    Tcl_HashEntry *entry = Tcl_CreateHashEntry(&nodes, path, &isNew);
+    if (!isNew)
+        return (Node *)Tcl_GetHashValue(entry);
+
+    Node *node = (Node *)ckalloc(sizeof(Node));
+    const char *key = (const char *)Tcl_GetHashKey(&nodes, entry);
+    const char *slash = strrchr(key, '/');
+    node->name = slash ? slash + 1 : key;
+    node->index = -1;
+    node->isdir = isdir;
+    node->size = 0;
+    node->time = 0;
+    node->mode = isdir ? (S_IFDIR | 0777) : (S_IFREG | 0555);
+    node->firstChild = node->lastChild = node->nextSibling = NULL;
+    Tcl_SetHashValue(entry, node);
+
+    if (*key) {
+        // NOTE: missing parent directories are created, some archives do not have them
+        Node *parent;
+        if (slash) {
+            Tcl_DString parentPath;
+            Tcl_DStringInit(&parentPath);
+            Tcl_DStringAppend(&parentPath, key, (int)(slash - key));
+            parent = addNode(Tcl_DStringValue(&parentPath), true);
+            Tcl_DStringFree(&parentPath);
+        } else {
+            parent = findNode("");
+        }
+        if (parent->isdir) {
+            if (parent->lastChild)
+                parent->lastChild->nextSibling = node;
+            else
+                parent->firstChild = node;
+            parent->lastChild = node;
+        }
+    }
+    return node;
+}
+
+SevenzipMount::Node *SevenzipMount::findNode(const char *path) {
+    Tcl_HashEntry *entry = Tcl_FindHashEntry(&nodes, path);
+    return entry ? (Node *)Tcl_GetHashValue(entry) : NULL;
+}
+
+int SevenzipMount::Mount(Tcl_Interp *interp, Tcl_Obj *mountpointObj) {
+    DEBUGLOG(this << " SevenzipMount::Mount " << Tcl_GetString(mountpointObj));
+    if (mountpoint) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("archive is already mounted", -1));
+        return TCL_ERROR;
+    }
+    Tcl_IncrRefCount(mountpointObj);
+    Tcl_Obj *normalized = Tcl_FSGetNormalizedPath(interp, mountpointObj);
+    if (!normalized) {
+        Tcl_DecrRefCount(mountpointObj);
+        return TCL_ERROR;
+    }
+    const char *path = Tcl_GetString(normalized);
+
+    Tcl_MutexLock(&mountsMutex);
+    for (SevenzipMount *mount = mounts; mount; mount = mount->next)
+        if (strcmp(mount->mountpoint, path) == 0) {
+            Tcl_MutexUnlock(&mountsMutex);
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("\"%s\" is already mounted", path));
+            Tcl_DecrRefCount(mountpointObj);
+            return TCL_ERROR;
+        }
+    mountpointLength = strlen(path);
+    mountpoint = (char *)ckalloc(mountpointLength + 1);
+    memcpy(mountpoint, path, mountpointLength + 1);
+    next = mounts;
+    mounts = this;
+    bool doRegister = !registered;
+    registered = true;
+    Tcl_MutexUnlock(&mountsMutex);
+    Tcl_DecrRefCount(mountpointObj);
+
+    // NOTE: the filesystem stays registered, it claims no paths without mounts
+    if (doRegister)
+        Tcl_FSRegister(NULL, &filesystem);
+    Tcl_FSMountsChanged(&filesystem);
+    return TCL_OK;
+}
+
+void SevenzipMount::Unmount() {
+    if (!mountpoint)
+        return;
+    DEBUGLOG(this << " SevenzipMount::Unmount " << mountpoint);
+    Tcl_MutexLock(&mountsMutex);
+    for (SevenzipMount **mount = &mounts; *mount; mount = &(*mount)->next)
+        if (*mount == this) {
+            *mount = next;
+            break;
+        }
+    Tcl_MutexUnlock(&mountsMutex);
+    ckfree(mountpoint);
+    mountpoint = NULL;
+    mountpointLength = 0;
+    next = NULL;
+    Tcl_FSMountsChanged(&filesystem);
+}
+
+SevenzipArchiveCmd *SevenzipMount::Find(Tcl_Obj *mountpointObj) {
+    Tcl_IncrRefCount(mountpointObj);
+    Tcl_Obj *normalized = Tcl_FSGetNormalizedPath(NULL, mountpointObj);
+    SevenzipArchiveCmd *archive = NULL;
+    if (normalized) {
+        Tcl_MutexLock(&mountsMutex);
+        for (SevenzipMount *mount = mounts; mount; mount = mount->next)
+            if (mount->owner == Tcl_GetCurrentThread()
+                    && strcmp(mount->mountpoint, Tcl_GetString(normalized)) == 0) {
+                archive = mount->archive;
+                break;
+            }
+        Tcl_MutexUnlock(&mountsMutex);
+    }
+    Tcl_DecrRefCount(mountpointObj);
+    return archive;
+}
+
+// NOTE: mounts are visible to the thread that created them only, the archive
+// NOTE: and its channels belong to the interpreter of that thread
+
+SevenzipMount::Node *SevenzipMount::findPath(Tcl_Obj *pathPtr, SevenzipMount **mountPtr) {
+    Tcl_Obj *normalized = Tcl_FSGetNormalizedPath(NULL, pathPtr);
+    if (!normalized)
+        return NULL;
+    const char *path = Tcl_GetString(normalized);
+    Tcl_ThreadId self = Tcl_GetCurrentThread();
+    SevenzipMount *found = NULL;
+    const char *relative = NULL;
+
+    Tcl_MutexLock(&mountsMutex);
+    for (SevenzipMount *mount = mounts; mount; mount = mount->next) {
+        if (mount->owner != self || strncmp(path, mount->mountpoint, mount->mountpointLength) != 0)
+            continue;
+        const char *rest = path + mount->mountpointLength;
+        if (mount->mountpointLength > 0 && mount->mountpoint[mount->mountpointLength - 1] == '/') {
+            found = mount;
+            relative = rest;
+            break;
+        }
+        if (*rest == '\0' || *rest == '/') {
+            found = mount;
+            relative = *rest ? rest + 1 : rest;
+            break;
+        }
+    }
+    Tcl_MutexUnlock(&mountsMutex);
+
+    if (mountPtr)
+        *mountPtr = found;
+    return found ? found->findNode(relative) : NULL;
+}
+
+int SevenzipMount::FsPathInFilesystem(Tcl_Obj *pathPtr, ClientData *clientDataPtr) {
+    // NOTE: every path of every thread is offered here, the list is changed
+    // NOTE: by other threads, so even the check for no mounts is locked
+    Tcl_MutexLock(&mountsMutex);
+    bool none = mounts == NULL;
+    Tcl_MutexUnlock(&mountsMutex);
+    if (none)
+        return -1;
+    SevenzipMount *mount;
+    findPath(pathPtr, &mount);
+    if (!mount)
+        return -1;
+    *clientDataPtr = NULL;
+    return TCL_OK;
+}
+
+Tcl_Obj *SevenzipMount::FsFilesystemPathType(Tcl_Obj *pathPtr) {
+    return Tcl_NewStringObj("sevenzip", -1);
+}
+
+Tcl_Obj *SevenzipMount::FsFilesystemSeparator(Tcl_Obj *pathPtr) {
+    return Tcl_NewStringObj("/", -1);
+}
+
+int SevenzipMount::FsStat(Tcl_Obj *pathPtr, Tcl_StatBuf *buf) {
+    Node *node = findPath(pathPtr, NULL);
+    if (!node) {
+        Tcl_SetErrno(ENOENT);
+        return -1;
+    }
+    memset(buf, 0, sizeof(Tcl_StatBuf));
+    buf->st_mode = node->mode;
+    buf->st_size = node->size;
+    buf->st_nlink = 1;
+    buf->st_mtime = node->time;
+    buf->st_atime = node->time;
+    buf->st_ctime = node->time;
+    buf->st_ino = node->index + 1;
+    return 0;
+}
+
+int SevenzipMount::FsAccess(Tcl_Obj *pathPtr, int mode) {
+    Node *node = findPath(pathPtr, NULL);
+    if (!node) {
+        Tcl_SetErrno(ENOENT);
+        return -1;
+    }
+    if (mode & W_OK) {
+        Tcl_SetErrno(EROFS);
+        return -1;
+    }
+    return 0;
+}
+
+Tcl_Channel SevenzipMount::FsOpenFileChannel(Tcl_Interp *interp, Tcl_Obj *pathPtr,
+        int mode, int permissions) {
+    SevenzipMount *mount;
+    Node *node = findPath(pathPtr, &mount);
+    int error = 0;
+    if (mode & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC | O_APPEND))
+        error = EROFS;
+    else if (!node)
+        error = ENOENT;
+    else if (node->isdir)
+        error = EISDIR;
+    if (error) {
+        Tcl_SetErrno(error);
+        if (interp)
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't open \"%s\": %s",
+                    Tcl_GetString(pathPtr), Tcl_PosixError(interp)));
+        return NULL;
+    }
+
+    if (node->index < 0)
+        return SevenzipMemoryChannel_Create(Tcl_NewByteArrayObj(NULL, 0));
+
+    Tcl_Channel channel;
+    HRESULT hr = mount->archive->OpenChannel(node->index, mount->password, channel);
+    if (hr != S_OK) {
+        Tcl_SetErrno(EIO);
+        if (interp)
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't open \"%s\": %s",
+                    Tcl_GetString(pathPtr), sevenzip::toBytes(sevenzip::getMessage(hr))));
+        return NULL;
+    }
+    return channel;
+}
+
+int SevenzipMount::FsMatchInDirectory(Tcl_Interp *interp, Tcl_Obj *resultPtr,
+        Tcl_Obj *pathPtr, const char *pattern, Tcl_GlobTypeData *types) {
+    int type = types ? types->type : 0;
+    int perm = types ? types->perm : 0;
+
+    if (type & TCL_GLOB_TYPE_MOUNT) {
+        // NOTE: report mount points located directly in the directory
+        Tcl_Obj *normalized = Tcl_FSGetNormalizedPath(NULL, pathPtr);
+        if (!normalized)
+            return TCL_OK;
+        const char *path = Tcl_GetString(normalized);
+        size_t length = strlen(path);
+        if (length > 0 && path[length - 1] == '/')
+            length--;
+        Tcl_ThreadId self = Tcl_GetCurrentThread();
+        Tcl_Obj *tails = Tcl_NewObj();
+        Tcl_IncrRefCount(tails);
+        Tcl_MutexLock(&mountsMutex);
+        for (SevenzipMount *mount = mounts; mount; mount = mount->next) {
+            if (mount->owner != self || mount->mountpointLength <= length + 1
+                    || strncmp(mount->mountpoint, path, length) != 0
+                    || mount->mountpoint[length] != '/')
+                continue;
+            const char *tail = mount->mountpoint + length + 1;
+            if (strchr(tail, '/'))
+                continue;
+            if (!pattern || Tcl_StringCaseMatch(tail, pattern, 0))
+                Tcl_ListObjAppendElement(NULL, tails, Tcl_NewStringObj(tail, -1));
+        }
+        Tcl_MutexUnlock(&mountsMutex);
+        Tcl_Size count;
+        Tcl_Obj **tailv;
+        Tcl_ListObjGetElements(NULL, tails, &count, &tailv);
+        for (Tcl_Size i = 0; i < count; i++)
+            Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_FSJoinToPath(pathPtr, 1, &tailv[i]));
+        Tcl_DecrRefCount(tails);
+        return TCL_OK;
+    }
+
+    Node *node = findPath(pathPtr, NULL);
+    if (!node)
+        return TCL_OK;
+
+    if (!pattern || !*pattern) {
+        // NOTE: no pattern, check the path itself
+        if (!type || (type & (node->isdir ? TCL_GLOB_TYPE_DIR : TCL_GLOB_TYPE_FILE)))
+            if (!(perm & TCL_GLOB_PERM_W))
+                Tcl_ListObjAppendElement(NULL, resultPtr, pathPtr);
+        return TCL_OK;
+    }
+    if (!node->isdir || (perm & TCL_GLOB_PERM_W))
+        return TCL_OK;
+
+    for (Node *child = node->firstChild; child; child = child->nextSibling) {
+        if (type && !(type & (child->isdir ? TCL_GLOB_TYPE_DIR : TCL_GLOB_TYPE_FILE)))
+            continue;
+        // NOTE: like the native filesystem, names starting with a dot are hidden
+        bool hidden = child->name[0] == '.';
+        if ((perm & TCL_GLOB_PERM_HIDDEN) ? !hidden : (hidden && pattern[0] != '.'))
+            continue;
+        if (!Tcl_StringCaseMatch(child->name, pattern, 0))
+            continue;
+        Tcl_Obj *tail = Tcl_NewStringObj(child->name, -1);
+        Tcl_IncrRefCount(tail);
+        Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_FSJoinToPath(pathPtr, 1, &tail));
+        Tcl_DecrRefCount(tail);
+    }
+    return TCL_OK;
+}
+
+int SevenzipMount::FsUtime(Tcl_Obj *pathPtr, struct utimbuf *tval) {
+    Tcl_SetErrno(EROFS);
+    return -1;
+}
+
+int SevenzipMount::FsCreateDirectory(Tcl_Obj *pathPtr) {
+    Tcl_SetErrno(EROFS);
+    return -1;
+}
+
+int SevenzipMount::FsRemoveDirectory(Tcl_Obj *pathPtr, int recursive, Tcl_Obj **errorPtr) {
+    Tcl_SetErrno(EROFS);
+    if (errorPtr) {
+        *errorPtr = pathPtr;
+        Tcl_IncrRefCount(pathPtr);
+    }
+    return -1;
+}
+
+int SevenzipMount::FsDeleteFile(Tcl_Obj *pathPtr) {
+    Tcl_SetErrno(EROFS);
+    return -1;
+}
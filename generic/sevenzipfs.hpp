@@ -0,0 +1,72 @@
+#ifndef SEVENZIPFS_H
+#define SEVENZIPFS_H
+
+#include <sevenzip.h>
+#include <tcl.h>
+
+class SevenzipArchiveCmd;
+
+// SevenzipMount shows the items of an open archive as a read-only directory
+// tree below a mount point. The tree is built once at mount time, all
+// filesystem requests are answered from it without scanning the archive.
+
+class SevenzipMount {
+
+public:
+
+    SevenzipMount(SevenzipArchiveCmd *archive, Tcl_Obj *password);
+    virtual ~SevenzipMount();
+
+    void AddItem(const char *path, int index, bool isdir, UInt64 size, UInt32 time, UInt32 mode);
+    int Mount(Tcl_Interp *interp, Tcl_Obj *mountpoint);
+    void Unmount();
+
+    static SevenzipArchiveCmd *Find(Tcl_Obj *mountpoint);
+
+private:
+
+    struct Node {
+        const char *name;
+        int index;
+        bool isdir;
+        UInt64 size;
+        UInt32 time;
+        UInt32 mode;
+        Node *firstChild;
+        Node *lastChild;
+        Node *nextSibling;
+    };
+
+    SevenzipArchiveCmd *archive;
+    Tcl_Obj *password;
+    Tcl_ThreadId owner;
+    char *mountpoint;
+    size_t mountpointLength;
+    Tcl_HashTable nodes;
+    SevenzipMount *next;
+
+    Node *addNode(const char *path, bool isdir);
+    Node *findNode(const char *path);
+
+    static SevenzipMount *mounts;
+    static Tcl_Mutex mountsMutex;
+    static bool registered;
+    static Node *findPath(Tcl_Obj *pathPtr, SevenzipMount **mountPtr);
+
+    static const Tcl_Filesystem filesystem;
+    static int FsPathInFilesystem(Tcl_Obj *pathPtr, ClientData *clientDataPtr);
+    static Tcl_Obj *FsFilesystemPathType(Tcl_Obj *pathPtr);
+    static Tcl_Obj *FsFilesystemSeparator(Tcl_Obj *pathPtr);
+    static int FsStat(Tcl_Obj *pathPtr, Tcl_StatBuf *buf);
+    static int FsAccess(Tcl_Obj *pathPtr, int mode);
+    static Tcl_Channel FsOpenFileChannel(Tcl_Interp *interp, Tcl_Obj *pathPtr,
+            int mode, int permissions);
+    static int FsMatchInDirectory(Tcl_Interp *interp, Tcl_Obj *resultPtr,
+            Tcl_Obj *pathPtr, const char *pattern, Tcl_GlobTypeData *types);
+    static int FsUtime(Tcl_Obj *pathPtr, struct utimbuf *tval);
+    static int FsCreateDirectory(Tcl_Obj *pathPtr);
+    static int FsRemoveDirectory(Tcl_Obj *pathPtr, int recursive, Tcl_Obj **errorPtr);
+    static int FsDeleteFile(Tcl_Obj *pathPtr);
+};
+
+#endif
@@ -3,6 +3,8 @@
 #include <sevenzip.h>
 #include <string.h>
 #include <wchar.h>
+#include <errno.h>
+#include <limits.h>
 
 #ifdef _WIN32
 #include <sys/utime.h>
@@ -14,6 +16,21 @@
 #ifndef S_ISDIR 
 #define S_ISDIR(_m_) (((_m_) & _S_IFDIR) == _S_IFDIR)
 #endif
+#ifndef S_ISREG
+#define S_ISREG(_m_) (((_m_) & _S_IFREG) == _S_IFREG)
+#endif
+#ifndef S_IFREG
+#define S_IFREG _S_IFREG
+#endif
+
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 
 #if defined(SEVENZIPSTREAM_DEBUG)
 #   include <iostream>
@@ -25,6 +42,14 @@
 struct TclObj {
     TclObj() = delete;
     TclObj(const wchar_t *str) : obj(Tcl_NewStringObj(sevenzip::toBytes(str), -1)) {Tcl_IncrRefCount(obj);};
+    TclObj(const wchar_t *str, Tcl_Obj *base) : TclObj(str) {
+        if (base) {
+            Tcl_Obj *path = Tcl_FSJoinToPath(base, 1, &obj);
+            Tcl_IncrRefCount(path);
+            Tcl_DecrRefCount(obj);
+            obj = path;
+        }
+    };
     ~TclObj() {Tcl_DecrRefCount(obj);};
     Tcl_Obj *get() {return obj;};
     private: Tcl_Obj *obj;
@@ -36,11 +61,13 @@ static void getAttrIndices(Tcl_Obj *name, int *indices);
 
 static HRESULT getResult(bool success);
 
-static Tcl_Channel getOpenChannel(Tcl_Interp *tclInterp, Tcl_Obj *channel, bool writable);
-static Tcl_Channel getFileChannel(Tcl_Interp *tclInterp, Tcl_Obj *filename, bool writable);
+static Tcl_Channel getOpenChannel(Tcl_Interp *tclInterp, Tcl_Obj *channel, bool writable, size_t bufferSize);
+static Tcl_Channel getFileChannel(Tcl_Interp *tclInterp, Tcl_Obj *filename, bool writable, size_t bufferSize);
 
 SevenzipInStream::SevenzipInStream(Tcl_Interp *interp) : 
-        tclInterp(interp), tclChannel(NULL), attached(false),
+        tclInterp(interp), tclChannel(NULL), attached(false), bufferSize(0), readahead(false),
+        useMmap(false), mapped(false),
+        prefetcher(NULL), metadata(NULL), memoryObj(NULL), memoryData(NULL), memorySize(0), memoryPosition(0),
         statBuf(Tcl_AllocStatBuf()), statPath(NULL) {
     DEBUGLOG(this << " SevenzipInStream");            
 }
@@ -51,6 +78,8 @@ SevenzipInStream::~SevenzipInStream() {
         ckfree(statPath);
     ckfree(statBuf);
     Close();
+    if (memoryObj)
+        Tcl_DecrRefCount(memoryObj);
 }
 
 HRESULT SevenzipInStream::Open(const wchar_t *filename) {
@@ -60,14 +89,61 @@ HRESULT SevenzipInStream::Open(const wchar_t *filename) {
     if (!filename)
         return E_FAIL;
 
+    Tcl_Obj *data = metadata ? metadata->FindData(sevenzip::toBytes(filename)) : NULL;
+    if (data) {
+        // NOTE: items given as data are read from the bytes of the value
+        Tcl_Size length;
+        memoryData = (char *)Tcl_GetByteArrayFromObj(data, &length);
+        Tcl_IncrRefCount(data);
+        memoryObj = data;
+        memorySize = (size_t)length;
+        memoryPosition = 0;
+        DEBUGLOG(this << " SevenzipInStream::Open data " << memorySize);
+        return S_OK;
+    }
+
+    if (prefetcher && prefetcher->Take(sevenzip::toBytes(filename), memoryData, memorySize)) {
+        DEBUGLOG(this << " SevenzipInStream::Open prefetched " << memorySize);
+        memoryPosition = 0;
+        return S_OK;
+    }
+
     TclObj path(filename);
-    tclChannel = getFileChannel(tclInterp, path.get(), false);
+    if (useMmap && mapFile(path.get())) {
+        DEBUGLOG(this << " SevenzipInStream::Open mapped " << memorySize);
+        return S_OK;
+    }
+    if (nativeFile.Open(path.get(), false)) {
+        DEBUGLOG(this << " SevenzipInStream::Open native");
+        return S_OK;
+    }
+    // NOTE: the channel reports why the file could not be opened
+    tclChannel = getFileChannel(tclInterp, path.get(), false, bufferSize);
     DEBUGLOG(this << " SevenzipInStream::Open channel " << tclChannel << " errno " << Tcl_GetErrno());
     return getResult(tclChannel);
 }
 
 HRESULT SevenzipInStream::Read(void* data, UInt32 size, UInt32 &processed) {
     DEBUGLOG(this << " SevenzipInStream::Read " << size);
+    if (memoryObj)
+        // NOTE: the bytes may have been regenerated if the value was shimmered
+        memoryData = (char *)Tcl_GetByteArrayFromObj(memoryObj, NULL);
+    if (memoryData) {
+        size_t available = memoryPosition < memorySize ? memorySize - memoryPosition : 0;
+        processed = (UInt32)(size < available ? size : available);
+        memcpy(data, memoryData + memoryPosition, processed);
+        memoryPosition += processed;
+        return S_OK;
+    }
+    if (nativeFile.IsOpen()) {
+        size_t done;
+        bool success = nativeFile.Read(data, size, done);
+        processed = (UInt32)done;
+        if (!success)
+            Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                    "couldn't read from input stream: %s", Tcl_PosixError(tclInterp)));
+        return getResult(success);
+    }
     if (!tclChannel)
         return S_FALSE;
 
@@ -82,6 +158,22 @@ HRESULT SevenzipInStream::Read(void* data, UInt32 size, UInt32 &processed) {
 
 HRESULT SevenzipInStream::Seek(Int64 offset, UInt32 origin, UInt64 &position) {
     DEBUGLOG(this << " SevenzipInStream::Seek " << offset << " as " << origin);
+    if (memoryData) {
+        Int64 base = origin == SEEK_CUR ? (Int64)memoryPosition
+                : origin == SEEK_END ? (Int64)memorySize : 0;
+        if (base + offset < 0)
+            return E_FAIL;
+        memoryPosition = (size_t)(base + offset);
+        position = (UInt64)memoryPosition;
+        return S_OK;
+    }
+    if (nativeFile.IsOpen()) {
+        bool success = nativeFile.Seek(offset, (int)origin, position);
+        if (!success)
+            Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                    "couldn't seek on input stream: %s", Tcl_PosixError(tclInterp)));
+        return getResult(success);
+    }
     if (!tclChannel)
         return S_FALSE;
 
@@ -96,6 +188,20 @@ HRESULT SevenzipInStream::Seek(Int64 offset, UInt32 origin, UInt64 &position) {
 
 void SevenzipInStream::Close() {
     DEBUGLOG(this << " SevenzipInStream::Close channel " << tclChannel << " attached " << attached);
+    if (mapped)
+        unmapFile();
+    nativeFile.Close();
+    if (memoryObj && !attached) {
+        Tcl_DecrRefCount(memoryObj);
+        memoryObj = NULL;
+        memoryData = NULL;
+        memorySize = memoryPosition = 0;
+    }
+    if (memoryData && !memoryObj) {
+        ckfree(memoryData);
+        memoryData = NULL;
+        memorySize = memoryPosition = 0;
+    }
     if (tclChannel && !attached) {
         Tcl_Close(tclInterp, tclChannel);
         tclChannel = NULL;
@@ -104,7 +210,73 @@ void SevenzipInStream::Close() {
 
 sevenzip::Istream *SevenzipInStream::Clone() const {
     DEBUGLOG(this << " SevenzipInStream::Clone");
-    return new SevenzipInStream(tclInterp);
+    SevenzipInStream *clone = new SevenzipInStream(tclInterp);
+    clone->SetPrefetcher(prefetcher);
+    clone->SetMetadata(metadata);
+    clone->SetMmap(useMmap);
+    clone->SetBufferSize(bufferSize);
+    clone->SetReadahead(readahead);
+    return clone;
+}
+
+bool SevenzipInStream::mapFile(Tcl_Obj *pathname) {
+    // NOTE: only regular files of the native filesystem can be mapped,
+    // NOTE: anything else is read through a channel
+    const void *nativePath = Tcl_FSGetNativePath(pathname);
+    if (!nativePath)
+        return false;
+#ifdef _WIN32
+    HANDLE file = CreateFileW((const wchar_t *)nativePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+            NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0 && (UInt64)size.QuadPart <= (size_t)-1)
+        mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+        return false;
+    void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!data)
+        return false;
+    memorySize = (size_t)size.QuadPart;
+#else
+    int fd = open((const char *)nativePath, O_RDONLY);
+    struct stat st;
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0
+            || (UInt64)st.st_size > (size_t)-1) {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+#ifdef MADV_SEQUENTIAL
+    // NOTE: headers are small, the data is read front to back
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+    memorySize = (size_t)st.st_size;
+#endif
+    memoryData = (char *)data;
+    memoryPosition = 0;
+    mapped = true;
+    return true;
+}
+
+void SevenzipInStream::unmapFile() {
+#ifdef _WIN32
+    UnmapViewOfFile(memoryData);
+#else
+    munmap(memoryData, memorySize);
+#endif
+    memoryData = NULL;
+    memorySize = memoryPosition = 0;
+    mapped = false;
 }
 
 bool SevenzipInStream::IsDir(const wchar_t* pathname) {
@@ -122,6 +294,8 @@ bool SevenzipInStream::IsDir(const wchar_t* pathname) {
 UInt64 SevenzipInStream::GetSize(const wchar_t* pathname) {
     DEBUGLOG(this << " SevenzipInStream::GetSize " << (pathname ? pathname : L"NULL")
             << " attached " << attached);
+    if (memoryObj && attached)
+        return memorySize;
     if (attached) {
         // NOTE: when attached to a channel, size is unknown
         // NOTE: could try to get size from channel, but not reliable
@@ -181,6 +355,9 @@ UInt32 SevenzipInStream::GetTime(const wchar_t *pathname) {
 
 bool SevenzipInStream::IsDir(Tcl_Obj *pathname) {
     DEBUGLOG(this << " SevenzipInStream::IsDir " << (pathname ? Tcl_GetString(pathname) : "NULL"));
+    auto *info = metadata ? metadata->Find(Tcl_GetString(pathname)) : NULL;
+    if (info)
+        return info->isdir;
     auto *stat = getStatBuf(pathname);
     if (stat)
         return S_ISDIR(Tcl_GetModeFromStat(stat));
@@ -189,6 +366,9 @@ bool SevenzipInStream::IsDir(Tcl_Obj *pathname) {
 
 UInt64 SevenzipInStream::GetSize(Tcl_Obj *pathname) {
     DEBUGLOG(this << " SevenzipInStream::GetSize " << (pathname ? Tcl_GetString(pathname) : "NULL"));
+    auto *info = metadata ? metadata->Find(Tcl_GetString(pathname)) : NULL;
+    if (info)
+        return info->size;
     auto *stat = getStatBuf(pathname);
     if (stat)
         return Tcl_GetSizeFromStat(stat);
@@ -198,6 +378,9 @@ UInt64 SevenzipInStream::GetSize(Tcl_Obj *pathname) {
 
 UInt32 SevenzipInStream::GetMode(Tcl_Obj *pathname) {
     DEBUGLOG(this << " SevenzipInStream::GetMode " << (pathname ? Tcl_GetString(pathname) : "NULL"));
+    auto *info = metadata ? metadata->Find(Tcl_GetString(pathname)) : NULL;
+    if (info)
+        return info->mode;
     auto *stat = getStatBuf(pathname);
     if (stat)
         return Tcl_GetModeFromStat(stat);
@@ -223,6 +406,9 @@ UInt32 SevenzipInStream::GetMode(Tcl_Obj *pathname) {
 
 UInt32 SevenzipInStream::GetAttr(Tcl_Obj *pathname) {
     DEBUGLOG(this << " SevenzipInStream::GetAttr " << (pathname ? Tcl_GetString(pathname) : "NULL"));
+    auto *info = metadata ? metadata->Find(Tcl_GetString(pathname)) : NULL;
+    if (info)
+        return info->attr;
     UInt32 attr = 0;
     int indices[ATTR_COUNT];
     Tcl_IncrRefCount(pathname);
@@ -251,6 +437,9 @@ UInt32 SevenzipInStream::GetAttr(Tcl_Obj *pathname) {
 
 UInt32 SevenzipInStream::GetTime(Tcl_Obj *pathname) {
     DEBUGLOG(this << " SevenzipInStream::GetTime " << (pathname ? Tcl_GetString(pathname) : "NULL"));
+    auto *info = metadata ? metadata->Find(Tcl_GetString(pathname)) : NULL;
+    if (info)
+        return info->time;
     auto *stat = getStatBuf(pathname);
     if (stat)
         return (UInt32)Tcl_GetModificationTimeFromStat(stat);        
@@ -262,19 +451,43 @@ HRESULT SevenzipInStream::AttachOpenChannel(Tcl_Obj *channel) {
     if (tclChannel || attached)
         return S_FALSE;
 
-    tclChannel = getOpenChannel(tclInterp, channel, false);
+    tclChannel = getOpenChannel(tclInterp, channel, false, bufferSize);
     if (!tclChannel)
         return E_FAIL;
     attached = true;
     return S_OK;
 };
 
+HRESULT SevenzipInStream::AttachObj(Tcl_Obj *data) {
+    DEBUGLOG(this << " SevenzipInStream::AttachObj " << data);
+    if (tclChannel || attached || !data)
+        return S_FALSE;
+
+    // NOTE: reads go straight to the bytes of the value, which is kept alive
+    // NOTE: by the stream; a shared value is never modified in place
+    Tcl_Size length;
+#if TCL_MAJOR_VERSION < 9
+    unsigned char *bytes = Tcl_GetByteArrayFromObj(data, &length);
+#else
+    unsigned char *bytes = Tcl_GetBytesFromObj(tclInterp, data, &length);
+#endif
+    if (!bytes)
+        return E_FAIL;
+    Tcl_IncrRefCount(data);
+    memoryObj = data;
+    memoryData = (char *)bytes;
+    memorySize = (size_t)length;
+    memoryPosition = 0;
+    attached = true;
+    return S_OK;
+}
+
 HRESULT SevenzipInStream::AttachFileChannel(Tcl_Obj *filename) {
     DEBUGLOG(this << " SevenzipInStream::AttachFileChannel " << (filename ? Tcl_GetString(filename) : "NULL"));
     if (tclChannel || attached)
         return S_FALSE;
 
-    tclChannel = getFileChannel(tclInterp, filename, true);
+    tclChannel = getFileChannel(tclInterp, filename, true, bufferSize);
     if (!tclChannel)
         return E_FAIL;
     attached = true;
@@ -292,6 +505,28 @@ Tcl_Channel SevenzipInStream::DetachChannel() {
     return channel;
 };
 
+void SevenzipInStream::SetBufferSize(size_t size) {
+    DEBUGLOG(this << " SevenzipInStream::SetBufferSize " << size);
+    bufferSize = size;
+    nativeFile.SetBufferSize(size);
+}
+
+void SevenzipInStream::SetReadahead(bool readahead) {
+    DEBUGLOG(this << " SevenzipInStream::SetReadahead " << readahead);
+    this->readahead = readahead;
+    nativeFile.SetReadahead(readahead);
+}
+
+void SevenzipInStream::SetPrefetcher(SevenzipPrefetcher *prefetcher) {
+    DEBUGLOG(this << " SevenzipInStream::SetPrefetcher " << prefetcher);
+    this->prefetcher = prefetcher;
+}
+
+void SevenzipInStream::SetMetadata(SevenzipMetadata *metadata) {
+    DEBUGLOG(this << " SevenzipInStream::SetMetadata " << metadata);
+    this->metadata = metadata;
+}
+
 Tcl_StatBuf *SevenzipInStream::getStatBuf(Tcl_Obj *pathname) {
     if (statPath && strcmp(statPath, Tcl_GetString(pathname)) == 0)
         return statBuf;
@@ -316,13 +551,23 @@ Tcl_StatBuf *SevenzipInStream::getStatBuf(Tcl_Obj *pathname) {
 
 
 SevenzipOutStream::SevenzipOutStream(Tcl_Interp *interp):
-        tclInterp(interp), tclChannel(NULL), attached(false) {
+        tclInterp(interp), tclChannel(NULL), attached(false), bufferSize(0),
+        sequential(false), sequentialPosition(0), memoryObj(NULL), memorySize(0), memoryPosition(0),
+        rangeOffset(0), rangeEnd((UInt64)-1), rangeDone(false),
+        baseDirectory(NULL), filterPaths(NULL), filterSelected(NULL), filterCount(0), filterNext(0), skipping(false), pending(false), lastParent(NULL) {
     DEBUGLOG(this << " SevenzipOutStream");
 }
 
 SevenzipOutStream::~SevenzipOutStream() {
     DEBUGLOG(this << " ~SevenzipOutStream");
     Close();
+    ApplyMetadata();
+    if (memoryObj)
+        Tcl_DecrRefCount(DetachObj());
+    if (baseDirectory)
+        Tcl_DecrRefCount(baseDirectory);
+    if (lastParent)
+        Tcl_DecrRefCount(lastParent);
 }
 
 HRESULT SevenzipOutStream::Open(const wchar_t *filename) {
@@ -331,15 +576,68 @@ HRESULT SevenzipOutStream::Open(const wchar_t *filename) {
         return S_OK;
     if (!filename)
         return E_FAIL;
+    if (!isSelected(filename, true)) {
+        skipping = true;
+        return S_OK;
+    }
 
-    TclObj path(filename);
-    tclChannel = getFileChannel(tclInterp, path.get(), true);
+    TclObj path(filename, baseDirectory);
+    if (baseDirectory)
+        makeParentDirectory(path.get());
+    if (nativeFile.Open(path.get(), true)) {
+        DEBUGLOG(this << " SevenzipOutStream::Open native");
+        return S_OK;
+    }
+    // NOTE: the channel reports why the file could not be opened
+    tclChannel = getFileChannel(tclInterp, path.get(), true, bufferSize);
     DEBUGLOG(this << " SevenzipOutStream::Open channel " << tclChannel << " errno " << Tcl_GetErrno());
     return getResult(tclChannel);
 }
 
 HRESULT SevenzipOutStream::Write(const void *data, UInt32 size, UInt32 &processed) {
     DEBUGLOG(this << " SevenzipOutStream::Write " << size);
+    if (skipping) {
+        processed = size;
+        return S_OK;
+    }
+    if (memoryObj) {
+        // NOTE: only the bytes of the range are kept, at their offset in the range
+        UInt64 start = memoryPosition > rangeOffset ? memoryPosition : rangeOffset;
+        UInt64 end = memoryPosition + size < rangeEnd ? memoryPosition + size : rangeEnd;
+        if (start < end) {
+            size_t first = (size_t)(start - rangeOffset);
+            size_t needed = (size_t)(end - rangeOffset);
+            Tcl_Size capacity;
+            unsigned char *bytes = Tcl_GetByteArrayFromObj(memoryObj, &capacity);
+            if (needed > (size_t)capacity) {
+                size_t grown = (size_t)capacity * 2;
+                if (grown < 65536)
+                    grown = 65536;
+                bytes = Tcl_SetByteArrayLength(memoryObj, (Tcl_Size)(needed > grown ? needed : grown));
+            }
+            if (first > memorySize)
+                memset(bytes + memorySize, 0, first - memorySize);
+            memcpy(bytes + first, (const char *)data + (start - memoryPosition), (size_t)(end - start));
+            if (needed > memorySize)
+                memorySize = needed;
+        }
+        memoryPosition += size;
+        processed = size;
+        if (memoryPosition >= rangeEnd) {
+            // NOTE: the range is complete, there is no need to decode the rest
+            rangeDone = true;
+            return E_ABORT;
+        }
+        return S_OK;
+    }
+    if (nativeFile.IsOpen()) {
+        bool success = nativeFile.Write(data, size);
+        processed = success ? size : 0;
+        if (!success)
+            Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                    "couldn't write to output stream: %s", Tcl_PosixError(tclInterp)));
+        return getResult(success);
+    }
     if (!tclChannel)
         return S_FALSE;
 
@@ -348,14 +646,44 @@ HRESULT SevenzipOutStream::Write(const void *data, UInt32 size, UInt32 &processe
     if (result < 0)
         Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
                 "couldn't write to output stream: %s", Tcl_PosixError(tclInterp)));
+    else if (sequential)
+        sequentialPosition += (UInt64)result;
     DEBUGLOG(this << " SevenzipOutStream::Write processed " << result << " errno " << Tcl_GetErrno());
     return getResult(result >= 0);
 }
 
 HRESULT SevenzipOutStream::Seek(Int64 offset, UInt32 origin, UInt64 &position) {
     DEBUGLOG(this << " SevenzipOutStream::Seek " << offset << " as " << origin);
+    if (memoryObj) {
+        Int64 base = origin == SEEK_CUR ? (Int64)memoryPosition
+                : origin == SEEK_END ? (Int64)(rangeOffset + memorySize) : 0;
+        if (base + offset < 0)
+            return E_FAIL;
+        memoryPosition = (UInt64)(base + offset);
+        position = memoryPosition;
+        return S_OK;
+    }
+    if (nativeFile.IsOpen()) {
+        bool success = nativeFile.Seek(offset, (int)origin, position);
+        if (!success)
+            Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                    "couldn't seek on output stream: %s", Tcl_PosixError(tclInterp)));
+        return getResult(success);
+    }
     if (!tclChannel)
         return S_FALSE;
+    if (sequential) {
+        // NOTE: formats written front to back (tar, gzip, xz, bzip2, ...) only
+        // NOTE: ask for the position, formats that go back to patch headers fail
+        Int64 target = origin == SEEK_SET ? offset : (Int64)sequentialPosition + offset;
+        if (target != (Int64)sequentialPosition) {
+            Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                    "couldn't seek on output stream: archive format needs a seekable channel", -1));
+            return E_FAIL;
+        }
+        position = sequentialPosition;
+        return S_OK;
+    }
 
     long long result = Tcl_Seek(tclChannel, offset, origin);
     position = (UInt64)result;
@@ -368,6 +696,10 @@ HRESULT SevenzipOutStream::Seek(Int64 offset, UInt32 origin, UInt64 &position) {
 
 void SevenzipOutStream::Close() {
     DEBUGLOG(this << " SevenzipOutStream::Close channel " << tclChannel << " attached " << attached);
+    skipping = false;
+    if (nativeFile.IsOpen() && !nativeFile.Close())
+        Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                "couldn't write to output stream: %s", Tcl_PosixError(tclInterp)));
     if (tclChannel && !attached) {
         Tcl_Close(tclInterp, tclChannel);
         tclChannel = NULL;
@@ -381,8 +713,12 @@ HRESULT SevenzipOutStream::Mkdir(const wchar_t* pathname) {
         return S_FALSE;
     if (!pathname)
         return S_FALSE;
+    if (!isSelected(pathname, true))
+        return S_OK;
 
-    TclObj path(pathname);
+    TclObj path(pathname, baseDirectory);
+    if (baseDirectory)
+        makeParentDirectory(path.get());
     return Mkdir(path.get());
 }
 
@@ -398,8 +734,17 @@ HRESULT SevenzipOutStream::SetMode(const wchar_t* pathname, UInt32 mode) {
         return S_FALSE;
     if (!pathname)
         return S_FALSE;
+    if (!isSelected(pathname))
+        return S_OK;
 
-    TclObj path(pathname);
+    if (baseDirectory) {
+        Metadata *metadata = deferMetadata(pathname);
+        if (metadata)
+            metadata->mode = mode;
+        return S_OK;
+    }
+
+    TclObj path(pathname, baseDirectory);
     return SevenzipOutStream::SetMode(path.get(), mode);
 }
 
@@ -410,8 +755,17 @@ HRESULT SevenzipOutStream::SetAttr(const wchar_t* pathname, UInt32 attr) {
         return S_FALSE;
     if (!pathname)
         return S_FALSE;
+    if (!isSelected(pathname))
+        return S_OK;
 
-    TclObj path(pathname);
+    if (baseDirectory) {
+        Metadata *metadata = deferMetadata(pathname);
+        if (metadata)
+            metadata->attr = attr;
+        return S_OK;
+    }
+
+    TclObj path(pathname, baseDirectory);
     return SevenzipOutStream::SetAttr(path.get(), attr);
 }
 
@@ -422,8 +776,17 @@ HRESULT SevenzipOutStream::SetTime(const wchar_t* pathname, UInt32 time) {
         return S_FALSE;
     if (!pathname)
         return S_FALSE;
+    if (!isSelected(pathname))
+        return S_OK;
 
-    TclObj path(pathname);
+    if (baseDirectory) {
+        Metadata *metadata = deferMetadata(pathname);
+        if (metadata)
+            metadata->time = time;
+        return S_OK;
+    }
+
+    TclObj path(pathname, baseDirectory);
     return SetTime(path.get(), time);
 }
 
@@ -495,14 +858,84 @@ HRESULT SevenzipOutStream::SetTime(Tcl_Obj* pathname, UInt32 time) {
     return S_OK;
 }
 
+HRESULT SevenzipOutStream::SetMetadata(Tcl_Obj* pathname, UInt32 time, UInt32 mode, UInt32 attr) {
+    DEBUGLOG(this << " SevenzipOutStream::SetMetadata " << (pathname ? Tcl_GetString(pathname) : "NULL")
+            << " " << time << " " << std::oct << mode << std::dec << " " << std::hex << attr << std::dec);
+    Tcl_IncrRefCount(pathname);
+    const void *nativePath = Tcl_FSGetNativePath(pathname);
+    if (!nativePath) {
+        // NOTE: other filesystems are set through their attributes
+        if (time > 0)
+            SetTime(pathname, time);
+        if (mode > 0)
+            SetMode(pathname, mode);
+        if (attr > 0)
+            SetAttr(pathname, attr);
+        Tcl_DecrRefCount(pathname);
+        return S_OK;
+    }
+    // NOTE: the time goes first, a read-only file can not be changed afterwards
+#ifdef _WIN32
+    if (time > 0) {
+        struct _utimbuf tval;
+        memset(&tval, 0, sizeof(tval));
+        tval.modtime = time;
+        _wutime((const wchar_t *)nativePath, &tval);
+    }
+    // NOTE: there are no permissions, attributes are added as in SetAttr
+    if (attr & 0x27) {
+        DWORD attributes = GetFileAttributesW((const wchar_t *)nativePath);
+        if (attributes != INVALID_FILE_ATTRIBUTES)
+            SetFileAttributesW((const wchar_t *)nativePath, attributes | (attr & 0x27));
+    }
+#else
+    if (time > 0) {
+        struct utimbuf tval;
+        memset(&tval, 0, sizeof(tval));
+        tval.modtime = time;
+        utime((const char *)nativePath, &tval);
+    }
+    if (mode > 0)
+        chmod((const char *)nativePath, (mode_t)(mode & 07777));
+    // NOTE: only some unix platforms have such attributes
+    if (attr & 0x27)
+        SetAttr(pathname, attr);
+#endif
+    Tcl_DecrRefCount(pathname);
+    return S_OK;
+}
+
+void SevenzipOutStream::ApplyMetadata() {
+    if (!pending)
+        return;
+    DEBUGLOG(this << " SevenzipOutStream::ApplyMetadata");
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(&pendingMetadata, &search);
+            entry; entry = Tcl_NextHashEntry(&search)) {
+        Metadata *metadata = (Metadata *)Tcl_GetHashValue(entry);
+        Tcl_Obj *item = Tcl_NewStringObj((const char *)Tcl_GetHashKey(&pendingMetadata, entry), -1);
+        Tcl_IncrRefCount(item);
+        Tcl_Obj *path = baseDirectory ? Tcl_FSJoinToPath(baseDirectory, 1, &item) : item;
+        SetMetadata(path, metadata->time, metadata->mode, metadata->attr);
+        Tcl_DecrRefCount(item);
+        ckfree((char *)metadata);
+    }
+    Tcl_DeleteHashTable(&pendingMetadata);
+    pending = false;
+}
+
 HRESULT SevenzipOutStream::AttachOpenChannel(Tcl_Obj *channel) {
     DEBUGLOG(this << " SevenzipOutStream::AttachOpenChannel " << (channel ? Tcl_GetString(channel) : "NULL"));
     if (tclChannel || attached)
         return S_FALSE;
 
-    tclChannel = getOpenChannel(tclInterp, channel, true);
+    tclChannel = getOpenChannel(tclInterp, channel, true, bufferSize);
     if (!tclChannel)
         return E_FAIL;
+    // NOTE: pipes and sockets can not tell their position, the stream keeps it
+    sequential = Tcl_Tell(tclChannel) < 0;
+    sequentialPosition = 0;
+    DEBUGLOG(this << " SevenzipOutStream::AttachOpenChannel sequential " << sequential);
     attached = true;
     return S_OK;
 };
@@ -512,13 +945,113 @@ HRESULT SevenzipOutStream::AttachFileChannel(Tcl_Obj *filename) {
     if (tclChannel || attached)
         return S_FALSE;
 
-    tclChannel = getFileChannel(tclInterp, filename, true);
+    tclChannel = getFileChannel(tclInterp, filename, true, bufferSize);
     if (!tclChannel)
         return E_FAIL;
     attached = true;
     return S_OK;
 };
 
+void SevenzipOutStream::SetDirectory(Tcl_Obj *directory) {
+    DEBUGLOG(this << " SevenzipOutStream::SetDirectory " << (directory ? Tcl_GetString(directory) : "NULL"));
+    if (directory)
+        Tcl_IncrRefCount(directory);
+    if (baseDirectory)
+        Tcl_DecrRefCount(baseDirectory);
+    baseDirectory = directory;
+}
+
+void SevenzipOutStream::SetFilter(int count, const char *const *paths, const char *selected) {
+    DEBUGLOG(this << " SevenzipOutStream::SetFilter " << count);
+    filterPaths = paths;
+    filterSelected = selected;
+    filterCount = count;
+    filterNext = 0;
+}
+
+void SevenzipOutStream::SetBufferSize(size_t size) {
+    DEBUGLOG(this << " SevenzipOutStream::SetBufferSize " << size);
+    bufferSize = size;
+    nativeFile.SetBufferSize(size);
+}
+
+bool SevenzipOutStream::isSelected(const wchar_t *pathname, bool next) {
+    if (!filterPaths)
+        return true;
+    char *path = sevenzip::toBytes(pathname);
+    if (!path)
+        return false;
+#ifdef _WIN32
+    for (char *p = path; *p; p++)
+        if (*p == '\\')
+            *p = '/';
+#endif
+    // NOTE: items are written in index order, the item is the first one
+    // NOTE: with this path from the current one on, so items that share a
+    // NOTE: path are told apart; metadata calls do not move to the next item
+    int i = filterNext > 0 ? filterNext - 1 : 0;
+    if (next)
+        i = filterNext;
+    for (; i < filterCount; i++) {
+        if (strcmp(filterPaths[i], path) == 0) {
+            if (next)
+                filterNext = i + 1;
+            return filterSelected[i] != 0;
+        }
+    }
+    return false;
+}
+
+SevenzipOutStream::Metadata *SevenzipOutStream::deferMetadata(const wchar_t *pathname) {
+    // NOTE: metadata of extracted items is set in one pass after all items are
+    // NOTE: written, so writing files does not change the time of their directory
+    char *path = sevenzip::toBytes(pathname);
+    if (!path)
+        return NULL;
+    if (!pending) {
+        Tcl_InitHashTable(&pendingMetadata, TCL_STRING_KEYS);
+        pending = true;
+    }
+    int isNew;
+    Tcl_HashEntry *entry = Tcl_CreateHashEntry(&pendingMetadata, path, &isNew);
+    if (isNew) {
+        Metadata *metadata = (Metadata *)ckalloc(sizeof(Metadata));
+        metadata->time = metadata->mode = metadata->attr = 0;
+        Tcl_SetHashValue(entry, metadata);
+    }
+    return (Metadata *)Tcl_GetHashValue(entry);
+}
+
+void SevenzipOutStream::makeParentDirectory(Tcl_Obj *pathname) {
+    Tcl_Size length;
+    Tcl_Obj *parts = Tcl_FSSplitPath(pathname, &length);
+    Tcl_IncrRefCount(parts);
+    if (length > 1) {
+        Tcl_Obj *parent = Tcl_FSJoinPath(parts, length - 1);
+        Tcl_IncrRefCount(parent);
+        // NOTE: items are usually grouped by directory, skip the check for the same parent
+        if (!lastParent || strcmp(Tcl_GetString(lastParent), Tcl_GetString(parent)) != 0) {
+            Tcl_StatBuf *stat = Tcl_AllocStatBuf();
+            for (Tcl_Size i = 1; i < length; i++) {
+                Tcl_Obj *dirname = Tcl_FSJoinPath(parts, i);
+                Tcl_IncrRefCount(dirname);
+                if (Tcl_FSStat(dirname, stat) != 0 && Tcl_FSCreateDirectory(dirname) != TCL_OK) {
+                    DEBUGLOG(this << " SevenzipOutStream::makeParentDirectory failed: "
+                            << Tcl_GetString(dirname));
+                }
+                Tcl_DecrRefCount(dirname);
+            }
+            ckfree((char *)stat);
+            Tcl_IncrRefCount(parent);
+            if (lastParent)
+                Tcl_DecrRefCount(lastParent);
+            lastParent = parent;
+        }
+        Tcl_DecrRefCount(parent);
+    }
+    Tcl_DecrRefCount(parts);
+}
+
 Tcl_Channel SevenzipOutStream::DetachChannel() {
     DEBUGLOG(this << " SevenzipOutStream::DetachChannel");
     if (!tclChannel)
@@ -527,9 +1060,929 @@ Tcl_Channel SevenzipOutStream::DetachChannel() {
     Tcl_Channel channel = tclChannel;
     tclChannel = NULL;
     attached = false;
+    sequential = false;
     return channel;
 };
 
+HRESULT SevenzipOutStream::AttachObj(Tcl_Obj *obj, UInt64 offset, UInt64 length) {
+    DEBUGLOG(this << " SevenzipOutStream::AttachObj " << obj << " " << offset << " " << length);
+    if (tclChannel || attached || !obj)
+        return S_FALSE;
+
+    // NOTE: bytes are written into the byte array that grows as needed,
+    // NOTE: the length is trimmed to the written size on detach; resizing
+    // NOTE: needs an unshared object, so the stream holds the only reference
+    Tcl_IncrRefCount(obj);
+    if (Tcl_IsShared(obj)) {
+        Tcl_DecrRefCount(obj);
+        return S_FALSE;
+    }
+    memoryObj = obj;
+    memorySize = 0;
+    memoryPosition = 0;
+    rangeOffset = offset;
+    rangeEnd = length < (UInt64)-1 - offset ? offset + length : (UInt64)-1;
+    rangeDone = false;
+    attached = true;
+    return S_OK;
+};
+
+Tcl_Obj *SevenzipOutStream::DetachObj() {
+    DEBUGLOG(this << " SevenzipOutStream::DetachObj " << memoryObj << " size " << memorySize);
+    if (!memoryObj)
+        return NULL;
+
+    Tcl_Obj *obj = memoryObj;
+    Tcl_SetByteArrayLength(obj, (Tcl_Size)memorySize);
+    memoryObj = NULL;
+    memorySize = 0;
+    memoryPosition = 0;
+    attached = false;
+    // NOTE: the reference of the stream is passed to the caller
+    return obj;
+};
+
+#define NATIVE_BUFFER_SIZE (1024 * 1024)
+
+// NOTE: positioned reads and writes leave no shared file offset behind, so
+// NOTE: the read-ahead thread and the stream can use the same descriptor
+static long long nativeRead(int fd, void *data, size_t size, UInt64 offset) {
+#ifdef _WIN32
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD done;
+    if (!ReadFile((HANDLE)_get_osfhandle(fd), data, size < INT_MAX ? (DWORD)size : INT_MAX, &done, &overlapped)) {
+        if (GetLastError() == ERROR_HANDLE_EOF)
+            return 0;
+        errno = EIO;
+        return -1;
+    }
+    return (long long)done;
+#else
+    return (long long)pread(fd, data, size, (off_t)offset);
+#endif
+}
+
+static long long nativeWrite(int fd, const void *data, size_t size, UInt64 offset) {
+#ifdef _WIN32
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD done;
+    if (!WriteFile((HANDLE)_get_osfhandle(fd), data, size < INT_MAX ? (DWORD)size : INT_MAX, &done, &overlapped)) {
+        errno = GetLastError() == ERROR_DISK_FULL ? ENOSPC : EIO;
+        return -1;
+    }
+    return (long long)done;
+#else
+    return (long long)pwrite(fd, data, size, (off_t)offset);
+#endif
+}
+
+SevenzipNativeFile::SevenzipNativeFile():
+        fd(-1), position(0), buffer(NULL), bufferSize(NATIVE_BUFFER_SIZE), openSize(0),
+        bufferOffset(0), bufferLength(0), writing(false), readahead(false), spare(NULL),
+        spareOffset(0), spareLength(0), spareError(0), spareState(IDLE),
+        worker(NULL), mutex(NULL), condition(NULL), running(false), stopping(false) {
+}
+
+SevenzipNativeFile::~SevenzipNativeFile() {
+    Close();
+    if (buffer)
+        ckfree(buffer);
+    if (spare)
+        ckfree(spare);
+    Tcl_ConditionFinalize(&condition);
+    Tcl_MutexFinalize(&mutex);
+}
+
+void SevenzipNativeFile::SetBufferSize(size_t size) {
+    // NOTE: the buffers of an open file keep their size until it is closed
+    bufferSize = size > 0 ? size : NATIVE_BUFFER_SIZE;
+}
+
+void SevenzipNativeFile::SetReadahead(bool readahead) {
+    if (!readahead)
+        stopWorker();
+    this->readahead = readahead;
+}
+
+bool SevenzipNativeFile::Open(Tcl_Obj *pathname, bool writable) {
+    if (fd >= 0)
+        return false;
+    // NOTE: paths of other filesystems have no native representation
+    Tcl_IncrRefCount(pathname);
+    const void *nativePath = Tcl_FSGetNativePath(pathname);
+#ifdef _WIN32
+    if (nativePath)
+        fd = _wopen((const wchar_t *)nativePath, writable
+                ? _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY : _O_RDONLY | _O_BINARY,
+                _S_IREAD | _S_IWRITE);
+#else
+    if (nativePath)
+        fd = open((const char *)nativePath, writable ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+#endif
+    Tcl_DecrRefCount(pathname);
+    if (fd < 0)
+        return false;
+    if (!buffer || openSize != bufferSize) {
+        if (buffer)
+            ckfree(buffer);
+        if (spare)
+            ckfree(spare);
+        buffer = (char *)ckalloc(bufferSize);
+        spare = NULL;
+        openSize = bufferSize;
+    }
+    position = bufferOffset = 0;
+    bufferLength = 0;
+    writing = writable;
+    return true;
+}
+
+bool SevenzipNativeFile::Read(void *data, size_t size, size_t &processed) {
+    processed = 0;
+    while (processed < size) {
+        if (position >= bufferOffset && position < bufferOffset + bufferLength) {
+            size_t offset = (size_t)(position - bufferOffset);
+            size_t count = bufferLength - offset < size - processed ? bufferLength - offset : size - processed;
+            memcpy((char *)data + processed, buffer + offset, count);
+            processed += count;
+            position += count;
+            continue;
+        }
+        if (readahead && takeSpare())
+            continue;
+        // NOTE: large reads go straight to the caller, small ones fill the buffer;
+        // NOTE: with read-ahead all reads go through the buffers
+        bool direct = !readahead && size - processed >= openSize;
+        char *target = direct ? (char *)data + processed : buffer;
+        long long result = nativeRead(fd, target, direct ? size - processed : openSize, position);
+        if (result < 0) {
+            Tcl_SetErrno(errno);
+            return false;
+        }
+        if (result == 0)
+            break;
+        if (direct) {
+            processed += (size_t)result;
+            position += (UInt64)result;
+        } else {
+            bufferOffset = position;
+            bufferLength = (size_t)result;
+            if (readahead)
+                postSpare();
+        }
+    }
+    return true;
+}
+
+bool SevenzipNativeFile::Write(const void *data, size_t size) {
+    if (bufferLength > 0 && (position != bufferOffset + bufferLength
+            || bufferLength + size > openSize) && !flush())
+        return false;
+    if (bufferLength == 0)
+        bufferOffset = position;
+    if (size >= openSize) {
+        // NOTE: the buffer is empty here, large blocks are written as they are
+        const char *bytes = (const char *)data;
+        size_t done = 0;
+        while (done < size) {
+            long long result = nativeWrite(fd, bytes + done, size - done, position + done);
+            if (result < 0) {
+                Tcl_SetErrno(errno);
+                return false;
+            }
+            done += (size_t)result;
+        }
+    } else {
+        memcpy(buffer + bufferLength, data, size);
+        bufferLength += size;
+    }
+    position += size;
+    return true;
+}
+
+bool SevenzipNativeFile::Seek(Int64 offset, int origin, UInt64 &newPosition) {
+    Int64 base = (Int64)position;
+    if (origin == SEEK_END) {
+        if (writing && !flush())
+            return false;
+#ifdef _WIN32
+        struct _stat64 st;
+        if (_fstat64(fd, &st) != 0) {
+#else
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+#endif
+            Tcl_SetErrno(errno);
+            return false;
+        }
+        base = (Int64)st.st_size;
+    } else if (origin == SEEK_SET) {
+        base = 0;
+    }
+    if (base + offset < 0) {
+        Tcl_SetErrno(EINVAL);
+        return false;
+    }
+    // NOTE: pending bytes are flushed by the next write that does not follow them
+    position = (UInt64)(base + offset);
+    newPosition = position;
+    return true;
+}
+
+bool SevenzipNativeFile::Close() {
+    if (fd < 0)
+        return true;
+    stopWorker();
+    bool success = !writing || flush();
+#ifdef _WIN32
+    if (_close(fd) != 0 && success) {
+#else
+    if (close(fd) != 0 && success) {
+#endif
+        Tcl_SetErrno(errno);
+        success = false;
+    }
+    fd = -1;
+    position = bufferOffset = 0;
+    bufferLength = 0;
+    return success;
+}
+
+bool SevenzipNativeFile::flush() {
+    size_t done = 0;
+    while (done < bufferLength) {
+        long long result = nativeWrite(fd, buffer + done, bufferLength - done, bufferOffset + done);
+        if (result < 0) {
+            Tcl_SetErrno(errno);
+            return false;
+        }
+        done += (size_t)result;
+    }
+    bufferLength = 0;
+    return true;
+}
+
+bool SevenzipNativeFile::takeSpare() {
+    if (!running)
+        return false;
+    bool taken = false;
+    Tcl_MutexLock(&mutex);
+    while (spareState == PENDING)
+        Tcl_ConditionWait(&condition, &mutex, NULL);
+    if (spareState == READY && spareError == 0
+            && position >= spareOffset && position < spareOffset + spareLength) {
+        char *swap = buffer;
+        buffer = spare;
+        spare = swap;
+        bufferOffset = spareOffset;
+        bufferLength = spareLength;
+        taken = true;
+    }
+    // NOTE: a miss or a failed read is repeated by the stream itself
+    spareState = IDLE;
+    Tcl_MutexUnlock(&mutex);
+    if (taken && bufferLength == openSize)
+        postSpare();
+    return taken;
+}
+
+void SevenzipNativeFile::postSpare() {
+    if (bufferLength < openSize)
+        // NOTE: end of file
+        return;
+    if (!running) {
+        if (!spare)
+            spare = (char *)ckalloc(openSize);
+        spareState = IDLE;
+        stopping = false;
+        running = true;
+        if (Tcl_CreateThread(&worker, Worker, this,
+                TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+            // NOTE: threads are not supported, read synchronously
+            running = false;
+            readahead = false;
+            return;
+        }
+    }
+    Tcl_MutexLock(&mutex);
+    spareOffset = bufferOffset + bufferLength;
+    spareLength = 0;
+    spareError = 0;
+    spareState = PENDING;
+    Tcl_ConditionNotify(&condition);
+    Tcl_MutexUnlock(&mutex);
+}
+
+void SevenzipNativeFile::stopWorker() {
+    if (!running)
+        return;
+    Tcl_MutexLock(&mutex);
+    stopping = true;
+    Tcl_ConditionNotify(&condition);
+    Tcl_MutexUnlock(&mutex);
+    int result;
+    Tcl_JoinThread(worker, &result);
+    running = false;
+    spareState = IDLE;
+}
+
+Tcl_ThreadCreateType SevenzipNativeFile::Worker(ClientData clientData) {
+    SevenzipNativeFile *file = (SevenzipNativeFile *)clientData;
+    Tcl_MutexLock(&file->mutex);
+    while (!file->stopping) {
+        if (file->spareState != PENDING) {
+            Tcl_ConditionWait(&file->condition, &file->mutex, NULL);
+            continue;
+        }
+        UInt64 offset = file->spareOffset;
+        Tcl_MutexUnlock(&file->mutex);
+        long long result = nativeRead(file->fd, file->spare, file->openSize, offset);
+        int error = result < 0 ? errno : 0;
+        Tcl_MutexLock(&file->mutex);
+        file->spareLength = result > 0 ? (size_t)result : 0;
+        file->spareError = error;
+        file->spareState = READY;
+        Tcl_ConditionNotify(&file->condition);
+    }
+    Tcl_MutexUnlock(&file->mutex);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+SevenzipBridge::SevenzipBridge():
+        owner(Tcl_GetCurrentThread()), worker(NULL), mutex(NULL), condition(NULL),
+        jobProc(NULL), jobData(NULL), jobResult(S_OK), running(false), joinable(false),
+        callProc(NULL), callData(NULL), callDone(false) {
+    DEBUGLOG(this << " SevenzipBridge");
+}
+
+SevenzipBridge::~SevenzipBridge() {
+    DEBUGLOG(this << " ~SevenzipBridge");
+    if (joinable)
+        Join();
+    Tcl_ConditionFinalize(&condition);
+    Tcl_MutexFinalize(&mutex);
+}
+
+bool SevenzipBridge::Start(HRESULT (*proc)(void *), void *clientData) {
+    DEBUGLOG(this << " SevenzipBridge::Start");
+    if (joinable || !IsOwner())
+        return false;
+    jobProc = proc;
+    jobData = clientData;
+    jobResult = S_OK;
+    running = true;
+    if (Tcl_CreateThread(&worker, Worker, this,
+            TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+        // NOTE: threads are not supported, caller has to run the job itself
+        DEBUGLOG(this << " SevenzipBridge::Start failed");
+        running = false;
+        return false;
+    }
+    joinable = true;
+    return true;
+}
+
+HRESULT SevenzipBridge::Join() {
+    DEBUGLOG(this << " SevenzipBridge::Join");
+    if (!IsOwner())
+        return E_FAIL;
+    if (!joinable)
+        return jobResult;
+    Tcl_MutexLock(&mutex);
+    while (running || (callProc && !callDone)) {
+        if (!Serve())
+            Tcl_ConditionWait(&condition, &mutex, NULL);
+    }
+    Tcl_MutexUnlock(&mutex);
+    int result;
+    Tcl_JoinThread(worker, &result);
+    joinable = false;
+    DEBUGLOG(this << " SevenzipBridge::Join result " << jobResult);
+    return jobResult;
+}
+
+bool SevenzipBridge::Serve() {
+    if (!callProc || callDone)
+        return false;
+    void (*proc)(const void *) = callProc;
+    const void *data = callData;
+    Tcl_MutexUnlock(&mutex);
+    proc(data);
+    Tcl_MutexLock(&mutex);
+    callDone = true;
+    Tcl_ConditionNotify(&condition);
+    return true;
+}
+
+void SevenzipBridge::Post(void (*proc)(const void *), const void *data) {
+    Tcl_MutexLock(&mutex);
+    while (callProc)
+        Tcl_ConditionWait(&condition, &mutex, NULL);
+    callProc = proc;
+    callData = data;
+    callDone = false;
+    Tcl_ConditionNotify(&condition);
+    while (!callDone)
+        Tcl_ConditionWait(&condition, &mutex, NULL);
+    callProc = NULL;
+    callData = NULL;
+    Tcl_ConditionNotify(&condition);
+    Tcl_MutexUnlock(&mutex);
+}
+
+Tcl_ThreadCreateType SevenzipBridge::Worker(ClientData clientData) {
+    SevenzipBridge *bridge = (SevenzipBridge *)clientData;
+    HRESULT result = bridge->jobProc(bridge->jobData);
+    Tcl_MutexLock(&bridge->mutex);
+    bridge->jobResult = result;
+    bridge->running = false;
+    Tcl_ConditionNotify(&bridge->condition);
+    Tcl_MutexUnlock(&bridge->mutex);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+SevenzipBridgeInStream::SevenzipBridgeInStream(SevenzipBridge *bridge,
+        sevenzip::Istream *stream, bool owned):
+        bridge(bridge), stream(stream), owned(owned) {
+    DEBUGLOG(this << " SevenzipBridgeInStream " << stream);
+}
+
+SevenzipBridgeInStream::~SevenzipBridgeInStream() {
+    DEBUGLOG(this << " ~SevenzipBridgeInStream");
+    if (owned)
+        bridge->Call([&] {delete stream;});
+}
+
+HRESULT SevenzipBridgeInStream::Open(const wchar_t *filename) {
+    HRESULT hr;
+    bridge->Call([&] {hr = stream->Open(filename);});
+    return hr;
+}
+
+HRESULT SevenzipBridgeInStream::Read(void* data, UInt32 size, UInt32 &processed) {
+    HRESULT hr;
+    bridge->Call([&] {hr = stream->Read(data, size, processed);});
+    return hr;
+}
+
+HRESULT SevenzipBridgeInStream::Seek(Int64 offset, UInt32 origin, UInt64 &position) {
+    HRESULT hr;
+    bridge->Call([&] {hr = stream->Seek(offset, origin, position);});
+    return hr;
+}
+
+void SevenzipBridgeInStream::Close() {
+    bridge->Call([&] {stream->Close();});
+}
+
+sevenzip::Istream *SevenzipBridgeInStream::Clone() const {
+    sevenzip::Istream *clone;
+    bridge->Call([&] {clone = stream->Clone();});
+    return clone ? new SevenzipBridgeInStream(bridge, clone, true) : NULL;
+}
+
+bool SevenzipBridgeInStream::IsDir(const wchar_t *pathname) {
+    bool result;
+    bridge->Call([&] {result = stream->IsDir(pathname);});
+    return result;
+}
+
+UInt64 SevenzipBridgeInStream::GetSize(const wchar_t *pathname) {
+    UInt64 result;
+    bridge->Call([&] {result = stream->GetSize(pathname);});
+    return result;
+}
+
+UInt32 SevenzipBridgeInStream::GetMode(const wchar_t *pathname) {
+    UInt32 result;
+    bridge->Call([&] {result = stream->GetMode(pathname);});
+    return result;
+}
+
+UInt32 SevenzipBridgeInStream::GetAttr(const wchar_t *pathname) {
+    UInt32 result;
+    bridge->Call([&] {result = stream->GetAttr(pathname);});
+    return result;
+}
+
+UInt32 SevenzipBridgeInStream::GetTime(const wchar_t *pathname) {
+    UInt32 result;
+    bridge->Call([&] {result = stream->GetTime(pathname);});
+    return result;
+}
+
+SevenzipBridgeOutStream::SevenzipBridgeOutStream(SevenzipBridge *bridge, sevenzip::Ostream *stream):
+        bridge(bridge), stream(stream) {
+    DEBUGLOG(this << " SevenzipBridgeOutStream " << stream);
+}
+
+HRESULT SevenzipBridgeOutStream::Open(const wchar_t *filename) {
+    HRESULT hr;
+    bridge->Call([&] {hr = stream->Open(filename);});
+    return hr;
+}
+
+HRESULT SevenzipBridgeOutStream::Write(const void *data, UInt32 size, UInt32 &processed) {
+    HRESULT hr;
+    bridge->Call([&] {hr = stream->Write(data, size, processed);});
+    return hr;
+}
+
+HRESULT SevenzipBridgeOutStream::Seek(Int64 offset, UInt32 origin, UInt64 &position) {
+    HRESULT hr;
+    bridge->Call([&] {hr = stream->Seek(offset, origin, position);});
+    return hr;
+}
+
+void SevenzipBridgeOutStream::Close() {
+    bridge->Call([&] {stream->Close();});
+}
+
+HRESULT SevenzipBridgeOutStream::Mkdir(const wchar_t* pathname) {
+    HRESULT hr;
+    bridge->Call([&] {hr = stream->Mkdir(pathname);});
+    return hr;
+}
+
+HRESULT SevenzipBridgeOutStream::SetMode(const wchar_t* pathname, UInt32 mode) {
+    HRESULT hr;
+    bridge->Call([&] {hr = stream->SetMode(pathname, mode);});
+    return hr;
+}
+
+HRESULT SevenzipBridgeOutStream::SetAttr(const wchar_t* pathname, UInt32 attr) {
+    HRESULT hr;
+    bridge->Call([&] {hr = stream->SetAttr(pathname, attr);});
+    return hr;
+}
+
+HRESULT SevenzipBridgeOutStream::SetTime(const wchar_t* pathname, UInt32 time) {
+    HRESULT hr;
+    bridge->Call([&] {hr = stream->SetTime(pathname, time);});
+    return hr;
+}
+
+SevenzipPrefetcher::SevenzipPrefetcher(size_t fileLimit, size_t memoryLimit):
+        queue(NULL), queueLength(0), queueSize(0), queueNext(0),
+        fileLimit(fileLimit), memoryLimit(memoryLimit), memoryUsed(0),
+        worker(NULL), mutex(NULL), condition(NULL), running(false), stopping(false) {
+    DEBUGLOG(this << " SevenzipPrefetcher");
+    Tcl_InitHashTable(&entries, TCL_STRING_KEYS);
+}
+
+SevenzipPrefetcher::~SevenzipPrefetcher() {
+    DEBUGLOG(this << " ~SevenzipPrefetcher");
+    Stop();
+    for (int i = 0; i < queueLength; i++) {
+        if (queue[i]->data)
+            ckfree(queue[i]->data);
+        ckfree(queue[i]->nativePath);
+        ckfree((char *)queue[i]);
+    }
+    if (queue)
+        ckfree((char *)queue);
+    Tcl_DeleteHashTable(&entries);
+    Tcl_ConditionFinalize(&condition);
+    Tcl_MutexFinalize(&mutex);
+}
+
+void SevenzipPrefetcher::Add(Tcl_Obj *pathname) {
+    if (running)
+        return;
+    // NOTE: only files of the native filesystem can be read without Tcl
+    Tcl_IncrRefCount(pathname);
+    const void *nativePath = Tcl_FSGetNativePath(pathname);
+    int isNew = 0;
+    Tcl_HashEntry *hashEntry = nativePath
+            ? Tcl_CreateHashEntry(&entries, Tcl_GetString(pathname), &isNew) : NULL;
+    if (isNew) {
+#ifdef _WIN32
+        size_t length = (wcslen((const wchar_t *)nativePath) + 1) * sizeof(wchar_t);
+#else
+        size_t length = strlen((const char *)nativePath) + 1;
+#endif
+        Entry *entry = (Entry *)ckalloc(sizeof(Entry));
+        entry->nativePath = ckalloc(length);
+        memcpy(entry->nativePath, nativePath, length);
+        entry->data = NULL;
+        entry->size = 0;
+        entry->state = QUEUED;
+        Tcl_SetHashValue(hashEntry, entry);
+        if (queueLength >= queueSize) {
+            queueSize = queueSize ? queueSize * 2 : 64;
+            queue = (Entry **)ckrealloc((char *)queue, queueSize * sizeof(Entry *));
+        }
+        queue[queueLength++] = entry;
+    }
+    Tcl_DecrRefCount(pathname);
+}
+
+bool SevenzipPrefetcher::Start() {
+    DEBUGLOG(this << " SevenzipPrefetcher::Start " << queueLength);
+    if (running || queueLength == 0)
+        return false;
+    running = true;
+    stopping = false;
+    if (Tcl_CreateThread(&worker, Worker, this,
+            TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+        running = false;
+        return false;
+    }
+    return true;
+}
+
+void SevenzipPrefetcher::Stop() {
+    if (!running)
+        return;
+    DEBUGLOG(this << " SevenzipPrefetcher::Stop");
+    Tcl_MutexLock(&mutex);
+    stopping = true;
+    Tcl_ConditionNotify(&condition);
+    Tcl_MutexUnlock(&mutex);
+    int result;
+    Tcl_JoinThread(worker, &result);
+    running = false;
+}
+
+bool SevenzipPrefetcher::Take(const char *pathname, char *&data, size_t &size) {
+    bool taken = false;
+    Tcl_MutexLock(&mutex);
+    Tcl_HashEntry *hashEntry = Tcl_FindHashEntry(&entries, pathname);
+    if (hashEntry) {
+        Entry *entry = (Entry *)Tcl_GetHashValue(hashEntry);
+        if (entry->state == READY) {
+            data = entry->data;
+            size = entry->size;
+            entry->data = NULL;
+            memoryUsed -= entry->size;
+            taken = true;
+            Tcl_ConditionNotify(&condition);
+        }
+        // NOTE: not read yet, the caller reads the file itself
+        if (entry->state != SKIPPED)
+            entry->state = TAKEN;
+    }
+    Tcl_MutexUnlock(&mutex);
+    DEBUGLOG(this << " SevenzipPrefetcher::Take " << pathname << " " << taken);
+    return taken;
+}
+
+bool SevenzipPrefetcher::readFile(Entry *entry) {
+#ifdef _WIN32
+    int fd = _wopen((const wchar_t *)entry->nativePath, _O_RDONLY | _O_BINARY);
+    struct _stat64 st;
+    if (fd < 0)
+        return false;
+    if (_fstat64(fd, &st) != 0 || !S_ISREG(st.st_mode) || (size_t)st.st_size > fileLimit) {
+        _close(fd);
+        return false;
+    }
+#else
+    int fd = open((const char *)entry->nativePath, O_RDONLY);
+    struct stat st;
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (size_t)st.st_size > fileLimit) {
+        close(fd);
+        return false;
+    }
+#endif
+    size_t size = (size_t)st.st_size;
+    char *data = (char *)ckalloc(size + 1);
+    size_t done = 0;
+    while (done < size) {
+#ifdef _WIN32
+        int result = _read(fd, data + done, (unsigned int)(size - done));
+#else
+        ssize_t result = read(fd, data + done, size - done);
+#endif
+        if (result <= 0)
+            break;
+        done += (size_t)result;
+    }
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+    if (done != size) {
+        ckfree(data);
+        return false;
+    }
+    entry->data = data;
+    entry->size = size;
+    return true;
+}
+
+Tcl_ThreadCreateType SevenzipPrefetcher::Worker(ClientData clientData) {
+    SevenzipPrefetcher *prefetcher = (SevenzipPrefetcher *)clientData;
+    Tcl_MutexLock(&prefetcher->mutex);
+    while (!prefetcher->stopping && prefetcher->queueNext < prefetcher->queueLength) {
+        if (prefetcher->memoryUsed >= prefetcher->memoryLimit) {
+            Tcl_ConditionWait(&prefetcher->condition, &prefetcher->mutex, NULL);
+            continue;
+        }
+        Entry *entry = prefetcher->queue[prefetcher->queueNext++];
+        if (entry->state != QUEUED)
+            continue;
+        entry->state = READING;
+        Tcl_MutexUnlock(&prefetcher->mutex);
+        bool success = prefetcher->readFile(entry);
+        Tcl_MutexLock(&prefetcher->mutex);
+        if (success && entry->state == READING) {
+            entry->state = READY;
+            prefetcher->memoryUsed += entry->size;
+        } else {
+            if (entry->data) {
+                ckfree(entry->data);
+                entry->data = NULL;
+            }
+            if (entry->state == READING)
+                entry->state = SKIPPED;
+        }
+    }
+    Tcl_MutexUnlock(&prefetcher->mutex);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+SevenzipMetadata::SevenzipMetadata(int threads):
+        list(NULL), listLength(0), listSize(0), listNext(0), threads(threads), mutex(NULL) {
+    DEBUGLOG(this << " SevenzipMetadata");
+    Tcl_InitHashTable(&entries, TCL_STRING_KEYS);
+}
+
+SevenzipMetadata::~SevenzipMetadata() {
+    DEBUGLOG(this << " ~SevenzipMetadata");
+    for (int i = 0; i < listLength; i++) {
+        if (list[i]->nativePath)
+            ckfree(list[i]->nativePath);
+        if (list[i]->data)
+            Tcl_DecrRefCount(list[i]->data);
+        ckfree((char *)list[i]);
+    }
+    if (list)
+        ckfree((char *)list);
+    Tcl_DeleteHashTable(&entries);
+    Tcl_MutexFinalize(&mutex);
+}
+
+void SevenzipMetadata::Add(Tcl_Obj *pathname) {
+    // NOTE: only files of the native filesystem can be stat'ed without Tcl
+    Tcl_IncrRefCount(pathname);
+    const void *nativePath = Tcl_FSGetNativePath(pathname);
+    int isNew = 0;
+    Tcl_HashEntry *hashEntry = nativePath
+            ? Tcl_CreateHashEntry(&entries, Tcl_GetString(pathname), &isNew) : NULL;
+    if (isNew) {
+#ifdef _WIN32
+        size_t length = (wcslen((const wchar_t *)nativePath) + 1) * sizeof(wchar_t);
+#else
+        size_t length = strlen((const char *)nativePath) + 1;
+#endif
+        Entry *entry = (Entry *)ckalloc(sizeof(Entry));
+        entry->nativePath = ckalloc(length);
+        memcpy(entry->nativePath, nativePath, length);
+        entry->data = NULL;
+        entry->valid = false;
+        Tcl_SetHashValue(hashEntry, entry);
+        if (listLength >= listSize) {
+            listSize = listSize ? listSize * 2 : 64;
+            list = (Entry **)ckrealloc((char *)list, listSize * sizeof(Entry *));
+        }
+        list[listLength++] = entry;
+    }
+    Tcl_DecrRefCount(pathname);
+}
+
+void SevenzipMetadata::AddData(Tcl_Obj *name, Tcl_Obj *data, UInt32 time, UInt32 mode) {
+    // NOTE: data items take the place of files with the same name
+    int isNew;
+    Tcl_HashEntry *hashEntry = Tcl_CreateHashEntry(&entries, Tcl_GetString(name), &isNew);
+    Entry *entry;
+    if (isNew) {
+        entry = (Entry *)ckalloc(sizeof(Entry));
+        entry->data = NULL;
+        Tcl_SetHashValue(hashEntry, entry);
+        if (listLength >= listSize) {
+            listSize = listSize ? listSize * 2 : 64;
+            list = (Entry **)ckrealloc((char *)list, listSize * sizeof(Entry *));
+        }
+        list[listLength++] = entry;
+    } else {
+        entry = (Entry *)Tcl_GetHashValue(hashEntry);
+        if (entry->nativePath)
+            ckfree(entry->nativePath);
+        if (entry->data)
+            Tcl_DecrRefCount(entry->data);
+    }
+    Tcl_Size length;
+    Tcl_GetByteArrayFromObj(data, &length);
+    Tcl_IncrRefCount(data);
+    entry->nativePath = NULL;
+    entry->data = data;
+    entry->info.isdir = false;
+    entry->info.size = (UInt64)length;
+    entry->info.mode = S_IFREG | (mode & 07777);
+    entry->info.time = time;
+    entry->info.attr = 0;
+    entry->valid = true;
+}
+
+Tcl_Obj *SevenzipMetadata::FindData(const char *name) {
+    Tcl_HashEntry *hashEntry = Tcl_FindHashEntry(&entries, name);
+    return hashEntry ? ((Entry *)Tcl_GetHashValue(hashEntry))->data : NULL;
+}
+
+void SevenzipMetadata::Scan() {
+    DEBUGLOG(this << " SevenzipMetadata::Scan " << listLength);
+    // NOTE: stat calls mostly wait for the disk, a few threads keep more
+    // NOTE: requests in flight; this thread takes its share of the work
+    Tcl_ThreadId workers[16];
+    int started = 0;
+    int wanted = threads - 1 < listLength / 1024 ? threads - 1 : listLength / 1024;
+    if (wanted > (int)(sizeof(workers)/sizeof(workers[0])))
+        wanted = (int)(sizeof(workers)/sizeof(workers[0]));
+    for (; started < wanted; started++)
+        if (Tcl_CreateThread(&workers[started], Worker, this,
+                TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK)
+            break;
+    scanEntries();
+    for (int i = 0; i < started; i++) {
+        int result;
+        Tcl_JoinThread(workers[i], &result);
+    }
+}
+
+const SevenzipMetadata::Info *SevenzipMetadata::Find(const char *pathname) {
+    Tcl_HashEntry *hashEntry = Tcl_FindHashEntry(&entries, pathname);
+    if (!hashEntry)
+        return NULL;
+    Entry *entry = (Entry *)Tcl_GetHashValue(hashEntry);
+    // NOTE: failed entries are left to the Tcl filesystem, which reports the error
+    return entry->valid ? &entry->info : NULL;
+}
+
+void SevenzipMetadata::statEntry(Entry *entry) {
+    if (!entry->nativePath)
+        return;
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_wstat64((const wchar_t *)entry->nativePath, &st) != 0)
+        return;
+    DWORD attributes = GetFileAttributesW((const wchar_t *)entry->nativePath);
+    if (attributes == INVALID_FILE_ATTRIBUTES)
+        return;
+    // NOTE: readonly, hidden, system and archive as in attrMasks
+    entry->info.attr = attributes & 0x27;
+#else
+    struct stat st;
+    if (stat((const char *)entry->nativePath, &st) != 0)
+        return;
+    entry->info.attr = 0;
+#if defined(UF_IMMUTABLE)
+    // NOTE: the -readonly attribute of Tcl on BSD and macOS
+    if (st.st_flags & UF_IMMUTABLE)
+        entry->info.attr |= 0x01;
+#endif
+#if defined(UF_HIDDEN) && defined(__APPLE__)
+    // NOTE: the -hidden attribute of Tcl on macOS
+    if (st.st_flags & UF_HIDDEN)
+        entry->info.attr |= 0x02;
+#endif
+#endif
+    entry->info.isdir = S_ISDIR(st.st_mode);
+    entry->info.size = (UInt64)st.st_size;
+    entry->info.mode = (UInt32)st.st_mode;
+    entry->info.time = (UInt32)st.st_mtime;
+    entry->valid = true;
+}
+
+void SevenzipMetadata::scanEntries() {
+    for (;;) {
+        // NOTE: entries are claimed in chunks to keep the lock cold
+        Tcl_MutexLock(&mutex);
+        int first = listNext;
+        int last = first + 256 < listLength ? first + 256 : listLength;
+        listNext = last;
+        Tcl_MutexUnlock(&mutex);
+        if (first >= last)
+            break;
+        for (int i = first; i < last; i++)
+            statEntry(list[i]);
+    }
+}
+
+Tcl_ThreadCreateType SevenzipMetadata::Worker(ClientData clientData) {
+    ((SevenzipMetadata *)clientData)->scanEntries();
+    TCL_THREAD_CREATE_RETURN;
+}
+
 int lastError(Tcl_Interp *interp, HRESULT hr) {
     if (Tcl_GetCharLength(Tcl_GetObjResult(interp)) == 0) {
         if (hr == S_OK)
@@ -546,7 +1999,7 @@ static HRESULT getResult(bool success) {
     return sevenzip::getResult(success);
 }
 
-static Tcl_Channel getOpenChannel(Tcl_Interp *tclInterp, Tcl_Obj *channel, bool writable) {
+static Tcl_Channel getOpenChannel(Tcl_Interp *tclInterp, Tcl_Obj *channel, bool writable, size_t bufferSize) {
     int mode;
     Tcl_Channel tclChannel = Tcl_GetChannel(tclInterp, Tcl_GetString(channel), &mode);
     if (tclChannel == NULL) {
@@ -562,16 +2015,31 @@ static Tcl_Channel getOpenChannel(Tcl_Interp *tclInterp, Tcl_Obj *channel, bool
             Tcl_SetChannelOption(tclInterp, tclChannel, "-blocking", "0") != TCL_OK) {
         return NULL;
     }
+    // NOTE: Tcl limits the channel buffers to 1 MB
+    if (bufferSize > 0)
+        Tcl_SetChannelBufferSize(tclChannel, bufferSize < 1024 * 1024 ? (Tcl_Size)bufferSize : 1024 * 1024);
     return tclChannel;
 }
 
-static Tcl_Channel getFileChannel(Tcl_Interp *tclInterp, Tcl_Obj *filename, bool writable) {
+static Tcl_Channel getFileChannel(Tcl_Interp *tclInterp, Tcl_Obj *filename, bool writable, size_t bufferSize) {
     Tcl_IncrRefCount(filename);
     Tcl_Channel tclChannel = Tcl_FSOpenFileChannel(tclInterp, filename, writable ? "wb" : "rb", 0644);
     Tcl_DecrRefCount(filename);
+    if (tclChannel && bufferSize > 0)
+        Tcl_SetChannelBufferSize(tclChannel, bufferSize < 1024 * 1024 ? (Tcl_Size)bufferSize : 1024 * 1024);
     return tclChannel;
 }
 
+// NOTE: the attribute indices of filesystems with a static attribute table
+// NOTE: are looked up once, they are the same for all their paths
+struct AttrIndexCache {
+    const Tcl_Filesystem *filesystem;
+    int indices[ATTR_COUNT];
+};
+static AttrIndexCache attrIndexCache[4];
+static int attrIndexCacheLength = 0;
+TCL_DECLARE_MUTEX(attrIndexCacheMutex)
+
 static void getAttrIndices(Tcl_Obj *name, int *indices) {
     static const char* const attrStrings[ATTR_COUNT] = {
         "-readonly",
@@ -580,11 +2048,21 @@ static void getAttrIndices(Tcl_Obj *name, int *indices) {
         "-archive",
         "-permissions"
     };
+    Tcl_IncrRefCount(name);
+    const Tcl_Filesystem *filesystem = Tcl_FSGetFileSystemForPath(name);
+    Tcl_MutexLock(&attrIndexCacheMutex);
+    for (int c = 0; c < attrIndexCacheLength; c++)
+        if (filesystem && attrIndexCache[c].filesystem == filesystem) {
+            memcpy(indices, attrIndexCache[c].indices, sizeof(attrIndexCache[c].indices));
+            Tcl_MutexUnlock(&attrIndexCacheMutex);
+            Tcl_DecrRefCount(name);
+            return;
+        }
+    Tcl_MutexUnlock(&attrIndexCacheMutex);
     for (int i = 0; i < ATTR_COUNT; i++)
         indices[i] = -1;
     const char **strings = NULL;
     Tcl_Obj *stringsList = NULL;
-    Tcl_IncrRefCount(name);
     strings = (const char **)Tcl_FSFileAttrStrings(name, &stringsList);
     Tcl_DecrRefCount(name);
     if (!strings && stringsList) {
@@ -610,4 +2088,13 @@ static void getAttrIndices(Tcl_Obj *name, int *indices) {
             Tcl_DecrRefCount(stringsList);
         }
     }
+    if (strings && !stringsList && filesystem) {
+        Tcl_MutexLock(&attrIndexCacheMutex);
+        if (attrIndexCacheLength < (int)(sizeof(attrIndexCache)/sizeof(attrIndexCache[0]))) {
+            attrIndexCache[attrIndexCacheLength].filesystem = filesystem;
+            memcpy(attrIndexCache[attrIndexCacheLength].indices, indices, sizeof(attrIndexCache[0].indices));
+            attrIndexCacheLength++;
+        }
+        Tcl_MutexUnlock(&attrIndexCacheMutex);
+    }
 }
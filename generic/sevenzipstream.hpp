@@ -4,6 +4,66 @@
 #include <sevenzip.h>
 #include <tcl.h>
 
+class SevenzipPrefetcher;
+class SevenzipMetadata;
+
+// SevenzipNativeFile reads and writes files of the native filesystem with
+// positioned system calls through a large buffer, it bypasses the encoding,
+// buffering and blocking layers of Tcl channels. Only one of reading and
+// writing is used for a file. With read-ahead, a worker thread reads the
+// next buffer of the file while the current one is consumed.
+
+class SevenzipNativeFile {
+
+public:
+
+    SevenzipNativeFile();
+    virtual ~SevenzipNativeFile();
+
+    void SetBufferSize(size_t size);
+    void SetReadahead(bool readahead);
+
+    bool Open(Tcl_Obj *pathname, bool writable);
+    bool IsOpen() {return fd >= 0;};
+    bool Read(void *data, size_t size, size_t &processed);
+    bool Write(const void *data, size_t size);
+    bool Seek(Int64 offset, int origin, UInt64 &newPosition);
+    bool Close();
+
+private:
+
+    int fd;
+    UInt64 position;
+    // NOTE: a read buffer holds the file bytes at bufferOffset, a write
+    // NOTE: buffer the pending bytes to be written at bufferOffset
+    char *buffer;
+    size_t bufferSize;
+    size_t openSize;
+    UInt64 bufferOffset;
+    size_t bufferLength;
+    bool writing;
+
+    // NOTE: the spare buffer is filled by the worker while it is PENDING
+    enum {IDLE, PENDING, READY};
+    bool readahead;
+    char *spare;
+    UInt64 spareOffset;
+    size_t spareLength;
+    int spareError;
+    int spareState;
+    Tcl_ThreadId worker;
+    Tcl_Mutex mutex;
+    Tcl_Condition condition;
+    bool running;
+    bool stopping;
+
+    bool flush();
+    bool takeSpare();
+    void postSpare();
+    void stopWorker();
+    static Tcl_ThreadCreateType Worker(ClientData clientData);
+};
+
 class SevenzipInStream:  public sevenzip::Istream {
 
 public:
@@ -32,6 +92,15 @@ public:
     HRESULT AttachOpenChannel(Tcl_Obj *channel);
     HRESULT AttachFileChannel(Tcl_Obj *filename);
     Tcl_Channel DetachChannel();    
+    HRESULT AttachObj(Tcl_Obj *data);
+    Tcl_Obj *GetObj() {return memoryObj;};
+
+    void SetPrefetcher(SevenzipPrefetcher *prefetcher);
+    void SetMetadata(SevenzipMetadata *metadata);
+    void SetMmap(bool mmap) {useMmap = mmap;};
+    void SetBufferSize(size_t size);
+    void SetReadahead(bool readahead);
+    bool GetReadahead() {return readahead;};
 
 private:
 
@@ -39,6 +108,22 @@ private:
     Tcl_Channel tclChannel;
     bool attached;
 
+    SevenzipNativeFile nativeFile;
+    size_t bufferSize;
+    bool readahead;
+
+    bool useMmap;
+    bool mapped;
+    bool mapFile(Tcl_Obj *pathname);
+    void unmapFile();
+
+    SevenzipPrefetcher *prefetcher;
+    SevenzipMetadata *metadata;
+    Tcl_Obj *memoryObj;
+    char *memoryData;
+    size_t memorySize;
+    size_t memoryPosition;
+
     Tcl_StatBuf *getStatBuf(Tcl_Obj *pathname);
     Tcl_StatBuf *statBuf;
     char *statPath;
@@ -66,15 +151,261 @@ public:
     HRESULT SetMode(Tcl_Obj* pathname, UInt32 mode);
     HRESULT SetAttr(Tcl_Obj* pathname, UInt32 attr);
     HRESULT SetTime(Tcl_Obj* pathname, UInt32 time);
+    HRESULT SetMetadata(Tcl_Obj *pathname, UInt32 time, UInt32 mode, UInt32 attr);
+    void ApplyMetadata();
     HRESULT AttachOpenChannel(Tcl_Obj *channel);
     HRESULT AttachFileChannel(Tcl_Obj *filename);
     Tcl_Channel DetachChannel();
+    // NOTE: the object must not be referenced by anybody else, DetachObj
+    // NOTE: returns it with a reference the caller has to release
+    HRESULT AttachObj(Tcl_Obj *obj, UInt64 offset = 0, UInt64 length = (UInt64)-1);
+    Tcl_Obj *DetachObj();
+    bool IsRangeDone() {return rangeDone;};
+
+    void SetDirectory(Tcl_Obj *directory);
+    // NOTE: paths and selection flags by item index, valid while extracting
+    void SetFilter(int count, const char *const *paths, const char *selected);
+    void SetBufferSize(size_t size);
 
 private:
 
     Tcl_Interp *tclInterp;
     Tcl_Channel tclChannel;
     bool attached;
+
+    SevenzipNativeFile nativeFile;
+    size_t bufferSize;
+
+    // NOTE: the attached channel can not seek, the position is counted here
+    bool sequential;
+    UInt64 sequentialPosition;
+
+    Tcl_Obj *memoryObj;
+    size_t memorySize;
+    UInt64 memoryPosition;
+    UInt64 rangeOffset;
+    UInt64 rangeEnd;
+    bool rangeDone;
+
+    Tcl_Obj *baseDirectory;
+    const char *const *filterPaths;
+    const char *filterSelected;
+    int filterCount;
+    int filterNext;
+    bool skipping;
+
+    // NOTE: item path -> metadata set after all items are written
+    struct Metadata {
+        UInt32 time;
+        UInt32 mode;
+        UInt32 attr;
+    };
+    Tcl_HashTable pendingMetadata;
+    bool pending;
+
+    bool isSelected(const wchar_t *pathname, bool next = false);
+    Metadata *deferMetadata(const wchar_t *pathname);
+    void makeParentDirectory(Tcl_Obj *pathname);
+    Tcl_Obj *lastParent;
+};
+
+// SevenzipBridge runs a 7-Zip job in a worker thread. Stream calls made by the
+// job or by the codec threads are passed to the thread that owns the Tcl
+// interpreter, which serves them until the job is done.
+
+class SevenzipBridge {
+
+public:
+
+    SevenzipBridge();
+    virtual ~SevenzipBridge();
+
+    bool IsOwner() {return Tcl_GetCurrentThread() == owner;};
+    bool Start(HRESULT (*proc)(void *), void *clientData);
+    HRESULT Join();
+
+    // NOTE: for owners that wait for the worker themselves, Serve and
+    // NOTE: IsRunning must be called with the bridge locked
+    void Lock() {Tcl_MutexLock(&mutex);};
+    void Unlock() {Tcl_MutexUnlock(&mutex);};
+    void Wait() {Tcl_ConditionWait(&condition, &mutex, NULL);};
+    void Notify() {Tcl_ConditionNotify(&condition);};
+    bool IsRunning() {return running;};
+    bool Serve();
+
+    template <typename F> void Call(const F &func) {
+        if (IsOwner())
+            func();
+        else
+            Post(&Invoke<F>, &func);
+    };
+
+private:
+
+    Tcl_ThreadId owner;
+    Tcl_ThreadId worker;
+    Tcl_Mutex mutex;
+    Tcl_Condition condition;
+
+    HRESULT (*jobProc)(void *);
+    void *jobData;
+    HRESULT jobResult;
+    bool running;
+    bool joinable;
+
+    void (*callProc)(const void *);
+    const void *callData;
+    bool callDone;
+
+    void Post(void (*proc)(const void *), const void *data);
+    template <typename F> static void Invoke(const void *func) {(*(const F *)func)();};
+    static Tcl_ThreadCreateType Worker(ClientData clientData);
+};
+
+class SevenzipBridgeInStream: public sevenzip::Istream {
+
+public:
+
+    SevenzipBridgeInStream(SevenzipBridge *bridge, sevenzip::Istream *stream, bool owned);
+    virtual ~SevenzipBridgeInStream();
+
+    virtual HRESULT Open(const wchar_t *filename) override;
+    virtual HRESULT Read(void* data, UInt32 size, UInt32 &processed) override;
+    virtual HRESULT Seek(Int64 offset, UInt32 origin, UInt64 &position) override;
+    virtual void Close() override;
+
+    virtual sevenzip::Istream* Clone() const override;
+
+    virtual bool IsDir(const wchar_t *pathname) override;
+    virtual UInt64 GetSize(const wchar_t *pathname) override;
+    virtual UInt32 GetMode(const wchar_t *pathname) override;
+    virtual UInt32 GetAttr(const wchar_t *pathname) override;
+    virtual UInt32 GetTime(const wchar_t *pathname) override;
+
+private:
+
+    SevenzipBridge *bridge;
+    sevenzip::Istream *stream;
+    bool owned;
+};
+
+class SevenzipBridgeOutStream: public sevenzip::Ostream {
+
+public:
+
+    SevenzipBridgeOutStream(SevenzipBridge *bridge, sevenzip::Ostream *stream);
+    virtual ~SevenzipBridgeOutStream() {};
+
+    virtual HRESULT Open(const wchar_t *filename) override;
+    virtual HRESULT Write(const void *data, UInt32 size, UInt32 &processedSize) override;
+    virtual HRESULT Seek(Int64 offset, UInt32 seekOrigin, UInt64 &newPosition) override;
+    virtual void Close() override;
+
+    virtual HRESULT Mkdir(const wchar_t* pathname) override;
+    virtual HRESULT SetMode(const wchar_t* pathname, UInt32 mode) override;
+    virtual HRESULT SetAttr(const wchar_t* pathname, UInt32 attr) override;
+    virtual HRESULT SetTime(const wchar_t* pathname, UInt32 time) override;
+
+private:
+
+    SevenzipBridge *bridge;
+    sevenzip::Ostream *stream;
+};
+
+// SevenzipPrefetcher reads small native files ahead of the encoder in its own
+// thread with plain system I/O, the input stream then takes their contents
+// from memory instead of reading them through Tcl channels.
+
+class SevenzipPrefetcher {
+
+public:
+
+    SevenzipPrefetcher(size_t fileLimit = 1024 * 1024, size_t memoryLimit = 64 * 1024 * 1024);
+    virtual ~SevenzipPrefetcher();
+
+    void Add(Tcl_Obj *pathname);
+    bool Start();
+    void Stop();
+    bool Take(const char *pathname, char *&data, size_t &size);
+
+private:
+
+    enum {QUEUED, READING, READY, TAKEN, SKIPPED};
+    struct Entry {
+        void *nativePath;
+        char *data;
+        size_t size;
+        int state;
+    };
+
+    Tcl_HashTable entries;
+    Entry **queue;
+    int queueLength;
+    int queueSize;
+    int queueNext;
+
+    size_t fileLimit;
+    size_t memoryLimit;
+    size_t memoryUsed;
+
+    Tcl_ThreadId worker;
+    Tcl_Mutex mutex;
+    Tcl_Condition condition;
+    bool running;
+    bool stopping;
+
+    bool readFile(Entry *entry);
+    static Tcl_ThreadCreateType Worker(ClientData clientData);
+};
+
+// SevenzipMetadata collects the metadata of the input files of an archive up
+// front. Files of the native filesystem are stat'ed by a few threads with
+// plain system calls, the input stream then answers the metadata requests of
+// the encoder from the table instead of asking the Tcl filesystem per file.
+// Items given as data have no file, their bytes are kept with the metadata
+// and the input stream reads them from memory.
+
+class SevenzipMetadata {
+
+public:
+
+    struct Info {
+        bool isdir;
+        UInt64 size;
+        UInt32 mode;
+        UInt32 time;
+        UInt32 attr;
+    };
+
+    SevenzipMetadata(int threads = 4);
+    virtual ~SevenzipMetadata();
+
+    void Add(Tcl_Obj *pathname);
+    void AddData(Tcl_Obj *name, Tcl_Obj *data, UInt32 time, UInt32 mode);
+    void Scan();
+    const Info *Find(const char *pathname);
+    Tcl_Obj *FindData(const char *name);
+
+private:
+
+    struct Entry {
+        void *nativePath;
+        Tcl_Obj *data;
+        bool valid;
+        Info info;
+    };
+
+    Tcl_HashTable entries;
+    Entry **list;
+    int listLength;
+    int listSize;
+    int listNext;
+    int threads;
+    Tcl_Mutex mutex;
+
+    void scanEntries();
+    static void statEntry(Entry *entry);
+    static Tcl_ThreadCreateType Worker(ClientData clientData);
 };
 
 int lastError(Tcl_Interp *interp, HRESULT hr);
@@ -184,13 +184,8 @@ proc vfs::sevenzip::open {zipfd name mode permissions} {
             if {[DirExists $zipfd $name]} {
                 vfs::filesystem posixerror $::vfs::posix(EISDIR)
             }
-            set nfd [vfs::memchan]
-            fconfigure $nfd -translation binary
-            $zipfd extract -c $nfd $name
-            fconfigure $nfd -translation auto
-            seek $nfd 0
-
-            return [list $nfd]
+            # decoded on demand, seeks back may decode the item again
+            return [list [$zipfd open $name]]
         }
         default {
             vfs::filesystem posixerror $::vfs::posix(EROFS)